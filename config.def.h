@@ -27,6 +27,12 @@ static char vtiden[] = "\033[?6c";
 static float cwscale = 1.0;
 static float chscale = 1.0;
 
+/*
+ * 1: draw the box-drawing and block characters (U+2500 to U+259F) with
+ * rectangles fitted to the cell instead of with the font
+ */
+static int boxdraw = 1;
+
 /*
  * word delimiter string
  *
@@ -34,6 +40,15 @@ static float chscale = 1.0;
  */
 static char worddelimiters[] = " ";
 
+/*
+ * hint mode: every match of hintregex (POSIX extended syntax) on the screen
+ * is labelled with one of hintkeys; typing the label copies the match.
+ */
+static char hintregex[] =
+	"(https?|ftp|file)://[][A-Za-z0-9._~:/?#@!$&'()*+,;=%-]+"
+	"|[A-Za-z0-9._/~+-]+:[0-9]+(:[0-9]+)?";
+static char hintkeys[] = "asdfghjklqwertyuiopzxcvbnm";
+
 /* selection timeouts (in milliseconds) */
 static unsigned int doubleclicktimeout = 300;
 static unsigned int tripleclicktimeout = 600;
@@ -42,6 +57,24 @@ static unsigned int tripleclicktimeout = 600;
 static unsigned int keyrepeatdelay = 500;
 static unsigned int keyrepeatinterval = 25;
 
+/*
+ * maximum number of pty reads (of BUFSIZ bytes each) per main loop
+ * iteration before input, timers and redraws are serviced again
+ */
+static unsigned int ttyreadbatch = 16;
+
+/*
+ * maximum size in bytes of an OSC, DCS, APC or PM string; longer strings
+ * are ignored
+ */
+static unsigned int strbufmax = 16 * 1024 * 1024;
+
+/*
+ * maximum decoded size in bytes of a clipboard set through OSC 52; larger
+ * payloads are dropped. 0 disables OSC 52.
+ */
+static unsigned int osc52max = 1024 * 1024;
+
 /* alt screens */
 static int allowaltscreen = 1;
 
@@ -51,6 +84,29 @@ static int allowaltscreen = 1;
  */
 static unsigned int blinktimeout = 800;
 
+/*
+ * printer and -o output is buffered and written at the latest this many
+ * milliseconds after it was printed. With printraw set, it is the bytes
+ * read from the shell as they are, written once per read, rather than
+ * each character as the parser saw it. That is meant for -o: a read
+ * that switches the printer on or off (CSI 5 i, CSI 4 i) is left out.
+ */
+static unsigned int printflushtimeout = 100;
+static int printraw = 0;
+
+/*
+ * longest time in milliseconds drawing is held back by a synchronized
+ * update (mode 2026); 0 ignores the mode.
+ */
+static unsigned int synctimeout = 200;
+
+/*
+ * threads drawing the lines of full redraws in bands, each with its own
+ * renderer; 0 or 1 draws on the main thread only. More than 1 draws with
+ * wl_shm and pixman in software, never with the DRM renderers.
+ */
+static unsigned int drawthreads = 0;
+
 /*
  * thickness of underline and bar cursors
  */
@@ -132,6 +188,12 @@ static unsigned int defaultrcs = 257;
  */
 static unsigned int cursorshape = 2;
 
+/*
+ * blinking timeout (set to 0 to disable blinking) for the blinking cursor
+ * shapes, which DECSCUSR selects with 0, 1, 3 and 5
+ */
+static unsigned int cursorblinktimeout = 600;
+
 /*
  * Default columns and rows numbers
  */
@@ -180,6 +242,10 @@ static Shortcut shortcuts[] = {
 	{ MOD_MASK_SHIFT,               XKB_KEY_Insert,         selpaste,       {.i =  0} },
 	{ MODKEY,                       XKB_KEY_Num_Lock,       numlock,        {.i =  0} },
 	{ MODKEY,                       XKB_KEY_Control_L,      iso14755,       {.i =  0} },
+	{ MODKEY|MOD_MASK_SHIFT,        XKB_KEY_U,              hintmode,       {.i =  0} },
+	{ MODKEY|MOD_MASK_SHIFT,        XKB_KEY_Return,         newsession,     {.i =  0} },
+	{ MODKEY|MOD_MASK_SHIFT,        XKB_KEY_braceright,     cyclesession,   {.i = +1} },
+	{ MODKEY|MOD_MASK_SHIFT,        XKB_KEY_braceleft,      cyclesession,   {.i = -1} },
 };
 
 /*
@@ -9,13 +9,14 @@ MANPREFIX = ${PREFIX}/share/man
 
 PKGCFG = wayland-client wayland-cursor xkbcommon wld
 XDG_SHELL_PROTO = `pkg-config --variable=pkgdatadir wayland-protocols`/stable/xdg-shell/xdg-shell.xml
+PRESENTATION_TIME_PROTO = `pkg-config --variable=pkgdatadir wayland-protocols`/stable/presentation-time/presentation-time.xml
 
 # includes and libs
 INCS = -I. -I/usr/include `pkg-config --cflags ${PKGCFG}`
-LIBS = -L/usr/lib -lc -lm -lrt -lutil `pkg-config --libs ${PKGCFG}`
+LIBS = -L/usr/lib -lc -lm -lrt -lutil -lpthread `pkg-config --libs ${PKGCFG}`
 
 # flags
-CPPFLAGS = -DVERSION=\"${VERSION}\" -D_XOPEN_SOURCE=600
+CPPFLAGS = -DVERSION=\"${VERSION}\" -D_XOPEN_SOURCE=600 -D_GNU_SOURCE
 CFLAGS += -g -std=c99 -pedantic -Wall -Wvariadic-macros -Os ${INCS} ${CPPFLAGS}
 LDFLAGS += -g ${LIBS}
 
@@ -6,7 +6,10 @@
 /* for BTN_* definitions */
 #include <linux/input.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <regex.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,10 +18,14 @@
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
@@ -29,11 +36,13 @@
 #include <xkbcommon/xkbcommon.h>
 #include <wld/wld.h>
 #include <wld/wayland.h>
+#include <wld/pixman.h>
 #include <fontconfig/fontconfig.h>
 #include <wchar.h>
 
 #include "arg.h"
 #include "xdg-shell-client-protocol.h"
+#include "presentation-time-client-protocol.h"
 
 char *argv0;
 
@@ -52,8 +61,18 @@ char *argv0;
 #define ESC_BUF_SIZ   (128*UTF_SIZ)
 #define ESC_ARG_SIZ   16
 #define STR_BUF_SIZ   ESC_BUF_SIZ
+#define DAEMON_MSG_SIZ (64*1024)
+#define PRINT_BUF_SIZ (64*1024)
+#define TTY_WRITE_MIN 256  /* least ttywrite() writes per call, see there */
+#define COLOR_CACHE_SIZ 256 /* power of two, at most 256 */
+#define DRAW_BAND_MIN 4      /* rows per thread worth waking it for */
 #define STR_ARG_SIZ   ESC_ARG_SIZ
-#define DRAW_BUF_SIZ  20*1024
+#define GLYPH_CACHE_RUNES 0x10000 /* runes whose glyph lookup is cached */
+#define IMG_MAX       4096 /* largest sixel image width and height */
+#define BENCH_RUNS    100  /* draws timed per -B measurement */
+#define BENCH_STREAM  (4 << 20) /* bytes of a -B parser stream */
+#define LAT_SAMPLES   4096 /* latest key latencies kept per stage */
+#define LAT_TIMEOUT   1000 /* ms a key waits for the frame showing it */
 #define XK_ANY_MOD    UINT_MAX
 #define XK_NO_MOD     0
 #define XK_SWITCH_MOD (1<<13)
@@ -82,9 +101,7 @@ char *argv0;
 #define LIMIT(x, a, b)		(x) = (x) < (a) ? (a) : (x) > (b) ? (b) : (x)
 #define ATTRCMP(a, b)		((a).mode != (b).mode || (a).fg != (b).fg || \
 				(a).bg != (b).bg)
-#define IS_SET(flag)		((term.mode & (flag)) != 0)
-#define TIMEDIFF(t1, t2)	((t1.tv_sec-t2.tv_sec)*1000 + \
-				(t1.tv_nsec-t2.tv_nsec)/1E6)
+#define IS_SET(flag)		((term->mode & (flag)) != 0)
 #define MODBIT(x, set, bit)	((set) ? ((x) |= (bit)) : ((x) &= ~(bit)))
 
 #define TRUECOLOR(r,g,b)	(1 << 24 | (r) << 16 | (g) << 8 | (b))
@@ -109,6 +126,7 @@ enum glyph_attribute {
 	ATTR_WRAP       = 1 << 8,
 	ATTR_WIDE       = 1 << 9,
 	ATTR_WDUMMY     = 1 << 10,
+	ATTR_IMAGE      = 1 << 11, /* fg is the image, bg the tile */
 	ATTR_BOLD_FAINT = ATTR_BOLD | ATTR_FAINT,
 };
 
@@ -147,6 +165,7 @@ enum term_mode {
 	MODE_PRINT       = 1 << 20,
 	MODE_UTF8        = 1 << 21,
 	MODE_SIXEL       = 1 << 22,
+	MODE_SYNC        = 1 << 23,
 	MODE_MOUSE       = MODE_MOUSEBTN|MODE_MOUSEMOTION|MODE_MOUSEX10\
 	                  |MODE_MOUSEMANY,
 };
@@ -161,15 +180,71 @@ enum charset {
 	CS_FIN
 };
 
+/* parser states, kept in the low bits of term->esc */
 enum escape_state {
-	ESC_START      = 1,
-	ESC_CSI        = 2,
-	ESC_STR        = 4,  /* OSC, PM, APC */
-	ESC_ALTCHARSET = 8,
-	ESC_STR_END    = 16, /* a final string was encountered */
-	ESC_TEST       = 32, /* Enter in test mode */
-	ESC_UTF8       = 64,
-	ESC_DCS        =128,
+	ESC_GROUND,
+	ESC_START,
+	ESC_CSI,
+	ESC_STR,             /* OSC, PM, APC, DCS */
+	ESC_ALTCHARSET,
+	ESC_TEST,            /* Enter in test mode */
+	ESC_UTF8,
+	ESC_NSTATES,
+	ESC_STATE      = 7,
+	ESC_STR_END    = 8,  /* a final string was encountered */
+	ESC_DCS        = 16,
+};
+
+/* character classes seen by the parser */
+enum char_class {
+	CC_PRINT,
+	CC_CTRL,     /* C0 controls and DEL without a class of their own */
+	CC_BEL,
+	CC_CAN,      /* CAN and SUB */
+	CC_ESC,
+	CC_C1,
+	CC_STRC1,    /* C1 string introducers: DCS, OSC, PM, APC */
+	CC_INTER,    /* 0x20-0x3F, CSI parameters and intermediates */
+	CC_FINAL,    /* 0x40-0x7E */
+	CC_CSI,      /* [ */
+	CC_TEST,     /* # */
+	CC_UTF8,     /* % */
+	CC_CHARSET,  /* ( ) * + */
+	CC_STR,      /* P _ ^ ] k */
+	CC_NCLASSES,
+};
+
+/* parser actions, in the high bits of esctable entries */
+enum esc_action {
+	EA_NONE,
+	EA_PRINT,
+	EA_EXEC,
+	EA_ESC,
+	EA_STRSTART,
+	EA_ESCDISPATCH,
+	EA_COLLECT,
+	EA_CSIDISPATCH,
+	EA_SELCHARSET,
+	EA_CHARSET,
+	EA_TEST,
+	EA_UTF8,
+	EA_STRPUT,
+	EA_STREND,
+};
+
+enum sixel_state {
+	SX_DATA,
+	SX_REPEAT,   /* ! Pn */
+	SX_COLOR,    /* # Pc ; Pu ; Px ; Py ; Pz */
+	SX_RASTER,   /* " Pan ; Pad ; Ph ; Pv */
+};
+
+enum key_mode {
+	KM_APPKEYPAD = 1 << 0,
+	KM_NUMLOCK   = 1 << 1,
+	KM_APPCURSOR = 1 << 2,
+	KM_CRLF      = 1 << 3,
+	KM_NMODES    = 1 << 4,
 };
 
 enum window_state {
@@ -209,6 +284,17 @@ typedef struct {
 
 typedef Glyph *Line;
 
+typedef struct {
+	int x1, x2; /* first and last column of a match */
+} Hint;
+
+typedef struct {
+	Hint *h;    /* url/path matches of the line */
+	int n;      /* nb of matches */
+	int siz;    /* allocated matches */
+	int stale;  /* line changed since it was last scanned */
+} HintLine;
+
 typedef struct {
 	Glyph attr; /* current char attributes */
 	int x;
@@ -231,12 +317,50 @@ typedef struct {
 /* ESC type [[ [<priv>] <arg> [;]] <mode>] ESC '\' */
 typedef struct {
 	char type;             /* ESC type ... */
-	char buf[STR_BUF_SIZ]; /* raw string */
-	int len;               /* raw string length */
+	char *buf;             /* raw string, grown up to strbufmax */
+	size_t siz;            /* allocated size of buf */
+	size_t len;            /* raw string length */
+	int overflow;          /* string exceeded strbufmax */
+	size_t sep[STR_ARG_SIZ-1]; /* offsets of the ';' found so far */
+	int nsep;
 	char *args[STR_ARG_SIZ];
 	int narg;              /* nb of args */
 } STREscape;
 
+/* OSC 52 payload, base64-decoded as it arrives */
+typedef struct {
+	int active;            /* the string so far is "52;<sel>;" */
+	char *buf;             /* decoded bytes, at most osc52max */
+	size_t siz, len;
+	uint acc;              /* bits of an incomplete quantum */
+	int nacc;              /* characters in acc */
+	int overflow;          /* payload exceeded osc52max */
+	int end;               /* padding seen, ignore the rest */
+	int query;             /* payload is "?", not answered */
+} Osc52;
+
+/* Decoded sixel image, referenced by ATTR_IMAGE cells */
+typedef struct {
+	uint32_t *px;             /* XRGB8888 pixels, NULL if unused */
+	int w, h;
+	struct wld_buffer *buf;   /* copy for the renderer, made on first draw */
+	int refs;                 /* cells of all sessions showing it */
+} Image;
+
+/* Streaming sixel decoder state */
+typedef struct {
+	int state;                /* command whose parameters are read */
+	int p[5], np;             /* numeric parameters */
+	int x, y;                 /* position of the next sixel */
+	int w, h;                 /* extent drawn so far */
+	int rw, rh;               /* size from the raster attributes */
+	int cw, ch;               /* allocated size of px */
+	int rep;                  /* repeat count of the next sixel */
+	uint32_t col, bg;
+	uint32_t pal[256];
+	uint32_t *px;
+} Sixel;
+
 /* Internal representation of the screen */
 typedef struct {
 	int row;      /* nb row */
@@ -244,7 +368,11 @@ typedef struct {
 	Line *line;   /* screen */
 	Line *alt;    /* alternate screen */
 	int *dirty;  /* dirtyness of lines */
+	int *blink;  /* lines that may hold blinking glyphs */
+	int *altblink; /* same for the alternate screen */
+	HintLine *hint; /* cached url/path matches of lines */
 	TCursor c;    /* cursor */
+	TCursor saved[2]; /* cursors saved for the main and alt screen */
 	int top;      /* top    scroll limit */
 	int bot;      /* bottom scroll limit */
 	int mode;     /* terminal mode flags */
@@ -254,6 +382,8 @@ typedef struct {
 	int icharset; /* selected charset for sequence */
 	int numlock; /* lock numbers in keyboard */
 	int *tabs;
+	int cursor;   /* cursor style */
+	int cursoroff; /* in the hidden phase of a blinking cursor */
 } Term;
 
 typedef struct {
@@ -274,29 +404,20 @@ typedef struct {
 	struct wl_data_device_manager *datadevmanager;
 	struct wl_data_device *datadev;
 	struct wl_data_offer *seloffer;
-	struct wl_surface *surface;
-	struct wl_buffer *buffer;
 	struct xdg_wm_base *wm;
-	struct xdg_surface *xdgsurface;
-	struct xdg_toplevel *toplevel;
+	struct wp_presentation *presentation; /* bound with -S */
 	XKB xkb;
-	bool configured;
+	struct Window *pointed; /* under the pointer */
 	int px, py; /* pointer x and y */
-	int tw, th; /* tty width and height */
-	int w, h; /* window width and height */
 	int ch; /* char height */
 	int cw; /* char width  */
-	int vis;
-	char state; /* focus, redraw, visible */
-	int cursor; /* cursor style */
-	struct wl_callback * framecb;
+	uint32_t serial; /* of the last key or button event */
 } Wayland;
 
 typedef struct {
 	struct wld_context *ctx;
 	struct wld_font_context *fontctx;
 	struct wld_renderer *renderer;
-	struct wld_buffer *buffer, *oldbuffer;
 } WLD;
 
 typedef struct {
@@ -349,6 +470,15 @@ typedef struct {
 	uint32_t tclick1, tclick2;
 } Selection;
 
+typedef struct {
+	int active;
+	struct {
+		int x, y;
+		char *s;
+	} v[64]; /* labelled matches while active */
+	int n;
+} Hints;
+
 typedef union {
 	int i;
 	uint ui;
@@ -367,10 +497,76 @@ typedef struct {
 	char str[32];
 	uint32_t key;
 	int len;
-	bool started;
-	struct timespec last;
 } Repeat;
 
+/* One-shot timer on CLOCK_MONOTONIC, kept in a min-heap by run() */
+typedef struct Timer Timer;
+struct Timer {
+	struct timespec when;
+	void (*fn)(Timer *);
+	int idx;        /* heap position + 1, 0 when not armed */
+};
+
+/* File descriptor registered with the epoll set of run() */
+typedef struct Watch Watch;
+struct Watch {
+	int fd;
+	void (*fn)(Watch *, uint32_t);
+};
+
+/* Config.h tables compiled into a keysym-indexed hash by keyinit() */
+typedef struct {
+	xkb_keysym_t k;
+	Shortcut **sc;           /* shortcuts for k, NULL terminated */
+	Key **key[KM_NMODES];   /* keys allowed in each key_mode combination */
+} Keyslot;
+
+typedef struct Window Window;
+
+/*
+ * A shell and the terminal it draws on. The parser and terminal code
+ * reach the loaded session's state through term, csiescseq, ... which
+ * sessionload() points here.
+ */
+typedef struct {
+	Watch watch;           /* first, ttyready() gets the session from it */
+	Term term;
+	CSIEscape csi;
+	STREscape str;
+	Osc52 osc52;
+	Sixel sixel;
+	Hints hints;           /* on the screen while the session is active */
+	int cmdfd;
+	pid_t pid;
+	int pending;           /* cmdfd has unread input */
+	char rest[UTF_SIZ];    /* incomplete utf8 char left by ttyread */
+	int nrest;
+	char *title;
+	int record;            /* ttyread copies its input to the -r file */
+	int dead;              /* shell reaped, closed by run() after the batch */
+	Window *win;           /* shows it or holds it in another tab */
+} Session;
+
+/*
+ * A toplevel and the buffers drawn for it. It shows one of the sessions
+ * it holds; st -d opens one per client on the same display connection.
+ */
+struct Window {
+	struct wl_surface *surface; /* NULL once closed */
+	struct xdg_surface *xdgsurface;
+	struct xdg_toplevel *toplevel;
+	struct wl_buffer *wlbuffer;
+	struct wld_buffer *buffer, *oldbuffer;
+	struct wl_callback *framecb;
+	bool configured;
+	bool needdraw;
+	int tw, th; /* tty width and height */
+	int w, h; /* window width and height */
+	int vis;
+	char state; /* focus, redraw, visible */
+	Session *shown;
+};
+
 /* function definitions used in config.h */
 static void numlock(const Arg *);
 static void selpaste(const Arg *);
@@ -382,6 +578,9 @@ static void printscreen(const Arg *) ;
 static void iso14755(const Arg *);
 static void toggleprinter(const Arg *);
 static void sendbreak(const Arg *);
+static void hintmode(const Arg *);
+static void newsession(const Arg *);
+static void cyclesession(const Arg *);
 
 /* Config.h for applying patches and the configuration. */
 #include "config.h"
@@ -399,21 +598,141 @@ typedef struct {
 	struct wld_font *match;
 	FcFontSet *set;
 	FcPattern *pattern;
+	uchar *glyphs;    /* 2 bits per rune: looked up, and found */
 } Font;
 
 /* Drawing Context */
 typedef struct {
 	uint32_t col[MAX(LEN(colorname), 256)];
-	Font font, bfont, ifont, ibfont;
+	Font font, bfont, ifont, ibfont; /* variants are opened on first use */
+	FcPattern *pattern; /* configured pattern the variants derive from */
 } DC;
 
+/* Rectangles drawing a box-drawing or block character in a cell */
+typedef struct {
+	short x, y, w, h;
+} BoxRect;
+
+typedef struct {
+	BoxRect r[8];
+	int n;     /* 0 if the font draws it */
+	int shade; /* quarters of the foreground mixed into the background */
+} Box;
+
+/* Colours wldraws() resolved for a glyph's colours, attributes and modes */
+typedef struct {
+	uint32_t fg, bg;
+	uint mode;       /* colour attributes, MODE_REVERSE and MODE_BLINK */
+	uint gen;        /* colorgen when resolved */
+	uint32_t rfg, rbg;
+} ColorCache;
+
+/* Renderer operations collected by wldraws() and run by dlsubmit() */
+typedef struct {
+	int x, y, w, h;
+	uint32_t color;
+} DLFill;
+
+typedef struct {
+	struct wld_font *font;
+	uint32_t color;
+	int x, y;         /* origin on the baseline */
+	int xend;         /* where the next run starts, -1 if it cannot merge */
+	size_t off, len;  /* bytes in DrawList.str */
+	int idx;          /* order of queueing, for a stable sort */
+} DLText;
+
+typedef struct {
+	struct wld_buffer *buf;
+	int dx, dy, sx, sy, w, h;
+} DLCopy;
+
+/* Fill layers of a DrawList, in the order dlsubmit() draws them */
+enum dl_layer {
+	DL_BG,    /* backgrounds, under everything */
+	DL_BOX,   /* box-drawing characters, over the text */
+	DL_DECO,  /* underlines, strikethrough and the cursor, over those */
+	DL_LAYERS
+};
+
+typedef struct {
+	DLFill *fill[DL_LAYERS];
+	int nfill[DL_LAYERS], fillsiz[DL_LAYERS];
+	DLText *text;
+	int ntext, textsiz;
+	char *str;
+	size_t nstr, strsiz;
+	DLCopy *copy;
+	int ncopy, copysiz;
+	int queued, calls;    /* operations and renderer calls of the frame */
+} DrawList;
+
+/* What a drawing thread needs for itself; see drawbands() */
+typedef struct {
+	struct wld_renderer *renderer;
+	DrawList list;
+	ColorCache colors[COLOR_CACHE_SIZ];
+	Rune *runes;       /* of the run drawline() collects, term->col long */
+	int nrunes;
+	pthread_t thread;
+	int x1, x2;
+	int *rows, nrows;  /* its band */
+} Painter;
+
+/* Startup steps reported by -S */
+enum startup_step {
+	STEP_DISPLAY,
+	STEP_FONT,
+	STEP_WINDOW,
+	STEP_CONFIGURE,
+	STEP_DRAW,
+	STEP_IFONT,
+	STEP_BFONT,
+	STEP_IBFONT,
+};
+
+/* Stages a key press goes through on its way to the screen, for -S */
+enum latency_stage {
+	LAT_SEND,    /* ttysend() wrote it to the shell */
+	LAT_ECHO,    /* ttyread() got the first output after that */
+	LAT_COMMIT,  /* draw() committed the frame showing it */
+	LAT_PRESENT, /* the compositor presented that frame */
+	LAT_LAST
+};
+
+typedef struct {
+	struct timespec key;          /* kbdkey() got it, zero if none */
+	struct timespec t[LAT_LAST];  /* zero until the stage is reached */
+} Latency;
+
 static void die(const char *, ...);
 static void draw(void);
 static void redraw(void);
 static void drawregion(int, int, int, int);
+static int drawstats(int *);
+static void drawline(int, int, int);
+static int drawsafe(int);
+static void drawbands(int, int, int, int);
+static void *drawworker(void *);
+static void dlfill(int, uint32_t, int, int, int, int);
+static void dltext(struct wld_font *, uint32_t, int, int, int, const Rune *,
+                   size_t);
+static void dlcopy(struct wld_buffer *, int, int, int, int, int, int);
+static void dlsubmit(void);
+static void dlsubmitfills(DLFill *, int, int);
+static int dlfillcmp(const void *, const void *);
+static int dltextcmp(const void *, const void *);
 static void execsh(void);
 static void stty(void);
 static void sigchld(int);
+static Session *sessionnew(Window *, int, int);
+static Session *sessionstart(Session *);
+static void sessionload(Session *);
+static void sessionswitch(Session *);
+static void sessionclose(Session *);
+static Window *winnew(int, int);
+static void winclose(Window *);
+static void windraw(Window *);
 static void run(void);
 static void cresize(int, int);
 
@@ -421,14 +740,58 @@ static void csidump(void);
 static void csihandle(void);
 static void csiparse(void);
 static void csireset(void);
-static int eschandle(uchar);
+static void eschandle(uchar);
 static void strdump(void);
 static void strhandle(void);
 static void strparse(void);
 static void strreset(void);
+static void sixelstart(void);
+static void sixelwrite(const uchar *, size_t);
+static void sixelend(int);
+static void sixelgrow(int, int);
+static void sixelcmd(void);
+static int sixelhue(int, int, int);
+static uint32_t sixelhls(int, int, int);
+static void timage(int);
+static void imgref(Glyph *, int);
+static void imgunref(Glyph *, int);
+static void strput(const char *, size_t);
+static void osc52start(void);
+static void osc52put(const char *, size_t);
+static void osc52emit(uint, int);
+static int osc52flush(void);
+
+static int timerbefore(Timer *, Timer *);
+static void timerplace(Timer *, int);
+static void timersift(int);
+static void timerset(Timer *, long);
+static void timerstop(Timer *);
+static int timernext(void);
+static void timerrun(void);
+static void blinktick(Timer *);
+static void watchadd(Watch *, uint32_t);
+static void watchdel(Watch *);
+static void ttyready(Watch *, uint32_t);
+static void wlready(Watch *, uint32_t);
+static void sigready(Watch *, uint32_t);
+static void pasteready(Watch *, uint32_t);
+static void pasteend(void);
+static void daemonpath(struct sockaddr_un *);
+static int daemoninit(void);
+static int daemonsend(struct sockaddr_un *);
+static void daemonput(char *, size_t *, int, const char *);
+static void daemonlisten(struct sockaddr_un *);
+static void daemonready(Watch *, uint32_t);
+static void daemonclientready(Watch *, uint32_t);
+static void repeattick(Timer *);
+static void synctick(Timer *);
+static void cursorblinktick(Timer *);
+static void cursorblinkreset(void);
 
-static int tattrset(int);
 static void tprinter(char *, size_t);
+static void printwrite(char *, size_t);
+static void printflush(void);
+static void printtick(Timer *);
 static void tdumpsel(void);
 static void tdumpline(int);
 static void tdump(void);
@@ -445,6 +808,8 @@ static void tnew(int, int);
 static void tnewline(int);
 static void tputtab(int);
 static void tputc(Rune);
+static void tputglyph(Rune, int);
+static int twrite(const char *, int);
 static void treset(void);
 static void tresize(int, int);
 static void tscrollup(int, int);
@@ -454,7 +819,6 @@ static void tsetchar(Rune, Glyph *, int, int);
 static void tsetscroll(int, int);
 static void tswapscreen(void);
 static void tsetdirt(int, int);
-static void tsetdirtattr(int);
 static void tsetmode(int, int, int *, int);
 static void tfulldirt(void);
 static void techo(Rune);
@@ -464,25 +828,52 @@ static void tdefutf8(char);
 static int32_t tdefcolor(int *, int *, int);
 static void tdeftran(char);
 static inline int match(uint, uint);
+static void keyinit(void);
+static int keymapped(xkb_keysym_t);
+static Keyslot *keyslot(xkb_keysym_t, int);
+static int keymode(void);
+static char *kmap(Keyslot *, uint);
+static char *keylookup(xkb_keysym_t, uint, Shortcut **);
 static void ttynew(void);
 static size_t ttyread(void);
+static void ttyrecord(const char *, size_t);
+static void replay(void);
 static void ttyresize(void);
 static void ttysend(char *, size_t);
 static void ttywrite(const char *, size_t);
 static void tstrsequence(uchar);
 
 static inline uchar sixd_to_8bit(int);
-static void wldraws(char *, Glyph, int, int, int, int);
+static void wldraws(const Rune *, Glyph, int, int, int, int);
 static void wldrawglyph(Glyph, int, int);
+static void wldrawimage(Glyph, int, int, int);
 static void wlclear(int, int, int, int);
 static void wldrawcursor(void);
 static void wlinit(void);
+static void painterinit(void);
 static void wlloadcols(void);
 static int wlsetcolorname(int, const char *);
 static void wlloadcursor(void);
 static int wlloadfont(Font *, FcPattern *);
 static void wlloadfonts(char *, double);
+static Font *wlloadvariant(int);
+static int wlhaschar(Font *, Rune);
+static int wlglyphfits(struct wld_font *, Rune, int);
+static void wlboxinit(void);
+static void wlboxline(Box *, int, int, int);
+static void wlboxrect(Box *, int, int, int, int);
+static int wlboxedge(const BoxRect *, int);
+static int wlisbox(Rune);
+static void wldrawbox(Rune, uint32_t, uint32_t, int, int);
+static void startstep(int);
+static void bench(void);
+static void benchfill(int);
+static void benchkeys(void);
+static void benchparse(void);
+static void benchsixel(void);
+static void wlresolvecolors(Glyph, uint32_t *, uint32_t *);
 static void wlsettitle(char *);
+static void wlshowtitle(void);
 static void wlresettitle(void);
 static void wlseturgency(int);
 static void wlsetsel(char*, uint32_t);
@@ -535,6 +926,21 @@ static void dataofferoffer(void *, struct wl_data_offer *, const char *);
 static void datasrctarget(void *, struct wl_data_source *, const char *);
 static void datasrcsend(void *, struct wl_data_source *, const char *, int32_t);
 static void datasrccancelled(void *, struct wl_data_source *);
+static void presclockid(void *, struct wp_presentation *, uint32_t);
+static void presfbsync(void *, struct wp_presentation_feedback *,
+		struct wl_output *);
+static void presfbpresented(void *, struct wp_presentation_feedback *,
+		uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t,
+		uint32_t);
+static void presfbdiscarded(void *, struct wp_presentation_feedback *);
+
+static void latkey(struct timespec *);
+static void lattick(Timer *);
+static int latset(struct timespec *);
+static void latstamp(int);
+static void latsample(int, struct timespec *, struct timespec *);
+static int latcmp(const void *, const void *);
+static void tracereport(void);
 
 static void selinit(void);
 static void selnormalize(void);
@@ -546,6 +952,12 @@ static void selsnap(int *, int *, int);
 static int x2col(int);
 static int y2row(int);
 
+static void hintinit(void);
+static void hintscan(int);
+static void hintleave(void);
+static void hintkey(xkb_keysym_t, uint32_t);
+static void hintdraw(int);
+
 static size_t utf8decode(char *, Rune *, size_t);
 static Rune utf8decodebyte(char, size_t *);
 static size_t utf8encode(Rune, char *);
@@ -577,21 +989,53 @@ static struct wl_data_device_listener datadevlistener =
 static struct wl_data_offer_listener dataofferlistener = { dataofferoffer };
 static struct wl_data_source_listener datasrclistener =
 	{ datasrctarget, datasrcsend, datasrccancelled };
+static struct wp_presentation_listener preslistener = { presclockid };
+static struct wp_presentation_feedback_listener presfblistener =
+	{ presfbsync, presfbpresented, presfbdiscarded };
 
 /* Globals */
 static DC dc;
 static Wayland wl;
 static WLD wld;
 static Cursor cursor;
-static Term term;
-static CSIEscape csiescseq;
-static STREscape strescseq;
-static int cmdfd;
-static pid_t pid;
+/* the loaded session's, see sessionload() */
+static Term *term;
+static CSIEscape *csiescseq;
+static STREscape *strescseq;
+static Osc52 *osc52;
+static Sixel *sixel;
 static Selection sel;
+static regex_t hintre;
+static Image *images;
+static int nimages;
 static Repeat repeat;
-static bool needdraw = true;
+static Timer *timers[8];
+static int ntimers;
+static Timer blinktimer = { .fn = blinktick };
+static Timer repeattimer = { .fn = repeattick };
+static Timer synctimer = { .fn = synctick };
+static Timer cursorblinktimer = { .fn = cursorblinktick };
+static Timer printtimer = { .fn = printtick };
+static Timer lattimer = { .fn = lattick };
+static int epfd;
+static Session **sessions;
+static int nsessions;
+static Session *active; /* shown and receiving input */
+/* term, csiescseq, ... point into it, active unless reading another */
+static Session *loaded;
+static Window **windows;
+static int nwindows;
+static Window *win; /* the loaded session's */
+static Watch wlwatch = { .fn = wlready };
+static Watch sigwatch = { .fn = sigready };
+static Watch pastewatch = { .fd = -1, .fn = pasteready };
+static Watch daemonwatch = { .fd = -1, .fn = daemonready };
+static Keyslot *keytab;
+static int keytabbits;
 static int iofd = 1;
+static char printbuf[PRINT_BUF_SIZ]; /* waiting for iofd */
+static size_t printlen;
+static Session *printer; /* whose output printbuf holds */
 static char **opt_cmd  = NULL;
 static char *opt_class = NULL;
 static char *opt_embed = NULL;
@@ -600,6 +1044,34 @@ static char *opt_io    = NULL;
 static char *opt_line  = NULL;
 static char *opt_name  = NULL;
 static char *opt_title = NULL;
+static char *opt_rec   = NULL;
+static char *opt_replay = NULL;
+static int opt_replayfast = 0;
+static int recfd = -1;
+static Box boxes[0xA0]; /* U+2500 to U+259F at the current cell size */
+static Painter mainpainter;
+static __thread Painter *painter = &mainpainter;
+static Painter *painters; /* drawthreads - 1 workers */
+static int npainters;
+static pthread_mutex_t drawlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drawstart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drawdone = PTHREAD_COND_INITIALIZER;
+static uint drawgen;  /* bumped to start the workers */
+static int drawbusy;  /* workers still drawing */
+static uint colorgen = 1; /* bumped when dc.col changes */
+static int opt_daemon  = 0;
+static int opt_trace   = 0;
+static int opt_bench   = 0;
+static Latency keylat;   /* of the key press on its way, with -S */
+static uint latus[LAT_LAST][LAT_SAMPLES]; /* microseconds from the key */
+static int latn[LAT_LAST];
+static int latdiscarded; /* key frames the compositor never showed */
+static int latdropped;   /* keys that showed nothing in LAT_TIMEOUT */
+static clockid_t latclock = CLOCK_MONOTONIC; /* the compositor's */
+static long traceframes, tracecalls, traceops; /* drawn since start, -S */
+static struct timespec starttime;
+static char *opt_dir   = NULL; /* working directory of the next session */
+static char **opt_env  = NULL; /* and its environment, if not st's */
 static int oldbutton   = 3; /* button event on startup: 3 = release */
 static int oldx, oldy;
 
@@ -781,7 +1253,7 @@ x2col(int x)
 	x -= borderpx;
 	x /= wl.cw;
 
-	return LIMIT(x, 0, term.col-1);
+	return LIMIT(x, 0, term->col-1);
 }
 
 int
@@ -790,18 +1262,18 @@ y2row(int y)
 	y -= borderpx;
 	y /= wl.ch;
 
-	return LIMIT(y, 0, term.row-1);
+	return LIMIT(y, 0, term->row-1);
 }
 
 int
 tlinelen(int y)
 {
-	int i = term.col;
+	int i = term->col;
 
-	if (term.line[y][i - 1].mode & ATTR_WRAP)
+	if (term->line[y][i - 1].mode & ATTR_WRAP)
 		return i;
 
-	while (i > 0 && term.line[y][i - 1].u == ' ')
+	while (i > 0 && term->line[y][i - 1].u == ' ')
 		--i;
 
 	return i;
@@ -832,7 +1304,7 @@ selnormalize(void)
 	if (i < sel.nb.x)
 		sel.nb.x = i;
 	if (tlinelen(sel.ne.y) <= sel.ne.x)
-		sel.ne.x = term.col - 1;
+		sel.ne.x = term->col - 1;
 }
 
 int
@@ -863,29 +1335,29 @@ selsnap(int *x, int *y, int direction)
 		 * Snap around if the word wraps around at the end or
 		 * beginning of a line.
 		 */
-		prevgp = &term.line[*y][*x];
+		prevgp = &term->line[*y][*x];
 		prevdelim = ISDELIM(prevgp->u);
 		for (;;) {
 			newx = *x + direction;
 			newy = *y;
-			if (!BETWEEN(newx, 0, term.col - 1)) {
+			if (!BETWEEN(newx, 0, term->col - 1)) {
 				newy += direction;
-				newx = (newx + term.col) % term.col;
-				if (!BETWEEN(newy, 0, term.row - 1))
+				newx = (newx + term->col) % term->col;
+				if (!BETWEEN(newy, 0, term->row - 1))
 					break;
 
 				if (direction > 0)
 					yt = *y, xt = *x;
 				else
 					yt = newy, xt = newx;
-				if (!(term.line[yt][xt].mode & ATTR_WRAP))
+				if (!(term->line[yt][xt].mode & ATTR_WRAP))
 					break;
 			}
 
 			if (newx >= tlinelen(newy))
 				break;
 
-			gp = &term.line[newy][newx];
+			gp = &term->line[newy][newx];
 			delim = ISDELIM(gp->u);
 			if (!(gp->mode & ATTR_WDUMMY) && (delim != prevdelim
 					|| (delim && gp->u != prevgp->u)))
@@ -903,17 +1375,17 @@ selsnap(int *x, int *y, int direction)
 		 * has set ATTR_WRAP at its end. Then the whole next or
 		 * previous line will be selected.
 		 */
-		*x = (direction < 0) ? 0 : term.col - 1;
+		*x = (direction < 0) ? 0 : term->col - 1;
 		if (direction < 0) {
 			for (; *y > 0; *y += direction) {
-				if (!(term.line[*y-1][term.col-1].mode
+				if (!(term->line[*y-1][term->col-1].mode
 						& ATTR_WRAP)) {
 					break;
 				}
 			}
 		} else if (direction > 0) {
-			for (; *y < term.row-1; *y += direction) {
-				if (!(term.line[*y][term.col-1].mode
+			for (; *y < term->row-1; *y += direction) {
+				if (!(term->line[*y][term->col-1].mode
 						& ATTR_WRAP)) {
 					break;
 				}
@@ -1035,7 +1507,7 @@ getsel(void)
 	if (sel.ob.x == -1)
 		return NULL;
 
-	bufsize = (term.col+1) * (sel.ne.y-sel.nb.y+1) * UTF_SIZ;
+	bufsize = (term->col+1) * (sel.ne.y-sel.nb.y+1) * UTF_SIZ;
 	ptr = str = xmalloc(bufsize);
 
 	/* append every set & selected glyph to the selection */
@@ -1046,13 +1518,13 @@ getsel(void)
 		}
 
 		if (sel.type == SEL_RECTANGULAR) {
-			gp = &term.line[y][sel.nb.x];
+			gp = &term->line[y][sel.nb.x];
 			lastx = sel.ne.x;
 		} else {
-			gp = &term.line[y][sel.nb.y == y ? sel.nb.x : 0];
-			lastx = (sel.ne.y == y) ? sel.ne.x : term.col-1;
+			gp = &term->line[y][sel.nb.y == y ? sel.nb.x : 0];
+			lastx = (sel.ne.y == y) ? sel.ne.x : term->col-1;
 		}
-		last = &term.line[y][MIN(lastx, linelen-1)];
+		last = &term->line[y][MIN(lastx, linelen-1)];
 		while (last >= gp && last->u == ' ')
 			--last;
 
@@ -1111,6 +1583,9 @@ selpaste(const Arg *dummy)
 	char buf[BUFSIZ], *str;
 
 	if (wl.seloffer) {
+		/* finish a paste still in progress first */
+		if (pastewatch.fd != -1)
+			pasteend();
 		if (IS_SET(MODE_BRCKTPASTE))
 			ttywrite("\033[200~", 6);
 		/* check if we are pasting from ourselves */
@@ -1124,25 +1599,252 @@ selpaste(const Arg *dummy)
 				left -= len;
 				str += len;
 			}
+		} else if (pipe(fds) < 0) {
+			fprintf(stderr, "pipe failed: %s\n", strerror(errno));
 		} else {
-			pipe(fds);
+			/* the data arrives asynchronously, see pasteready */
+			fcntl(fds[0], F_SETFL, O_NONBLOCK);
+			fcntl(fds[0], F_SETFD, FD_CLOEXEC);
 			wl_data_offer_receive(wl.seloffer, "text/plain", fds[1]);
-			wl_display_flush(wl.dpy);
 			close(fds[1]);
-			while ((len = read(fds[0], buf, sizeof buf)) > 0) {
-				selwritebuf(buf, len);
-			}
-			close(fds[0]);
+			pastewatch.fd = fds[0];
+			watchadd(&pastewatch, EPOLLIN);
+			return;
 		}
 		if (IS_SET(MODE_BRCKTPASTE))
 			ttywrite("\033[201~", 6);
 	}
 }
 
+void
+pasteready(Watch *w, uint32_t events)
+{
+	char buf[BUFSIZ];
+	ssize_t len;
+
+	while ((len = read(w->fd, buf, sizeof buf)) > 0)
+		selwritebuf(buf, len);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	pasteend();
+}
+
+/*
+ * st -d: the first instance listens on a socket and every later one
+ * hands its command and working directory over to it and exits, so that
+ * the command runs in a new session without loading fonts again.
+ */
+void
+daemonpath(struct sockaddr_un *sa)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	const char *dpy = getenv("WAYLAND_DISPLAY");
+
+	/* only a directory of the user's own keeps others off the socket */
+	if (!dir)
+		die("-d needs XDG_RUNTIME_DIR\n");
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (snprintf(sa->sun_path, sizeof(sa->sun_path), "%s/st-%s", dir,
+	             dpy ? dpy : "wayland-0") >= sizeof(sa->sun_path))
+		die("socket path in %s too long\n", dir);
+}
+
+/*
+ * Hands the command over to a running st -d and returns 1, or becomes
+ * it. The lock keeps two started at once from both becoming it.
+ */
+int
+daemoninit(void)
+{
+	struct sockaddr_un sa;
+	struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	char lock[sizeof(sa.sun_path) + 5];
+	int fd, sent;
+
+	daemonpath(&sa);
+	snprintf(lock, sizeof(lock), "%s.lock", sa.sun_path);
+	if ((fd = open(lock, O_RDWR | O_CREAT, 0600)) < 0)
+		die("open %s failed: %s\n", lock, strerror(errno));
+	while (fcntl(fd, F_SETLKW, &fl) < 0) {
+		if (errno != EINTR)
+			die("lock %s failed: %s\n", lock, strerror(errno));
+	}
+	if (!(sent = daemonsend(&sa)))
+		daemonlisten(&sa);
+	close(fd);
+	return sent;
+}
+
+int
+daemonsend(struct sockaddr_un *sa)
+{
+	char buf[DAEMON_MSG_SIZ], cwd[PATH_MAX], **p;
+	size_t len = 0;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+		die("socket failed: %s\n", strerror(errno));
+	if (connect(fd, (struct sockaddr *)sa, sizeof(*sa)) < 0) {
+		close(fd);
+		return 0;
+	}
+	/* the command opens a tab in the window that is already there */
+	if (opt_class || opt_font || opt_name || opt_embed || opt_io ||
+	    opt_rec || opt_replay)
+		die("-c, -f, -n, -o, -p, -P, -r and -w do not apply to a tab"
+		    " of the running st -d\n");
+
+	/*
+	 * One packet of NUL terminated strings, each tagged by its first
+	 * byte: the directory, the title, the environment and the command.
+	 */
+	if (!getcwd(cwd, sizeof(cwd)))
+		die("getcwd failed: %s\n", strerror(errno));
+	daemonput(buf, &len, 'd', cwd);
+	if (opt_title)
+		daemonput(buf, &len, 't', opt_title);
+	for (p = environ; *p; p++)
+		daemonput(buf, &len, 'e', *p);
+	for (p = opt_cmd; p && *p; p++)
+		daemonput(buf, &len, 'a', *p);
+	if (send(fd, buf, len, 0) < 0)
+		die("send to the daemon failed: %s\n", strerror(errno));
+	close(fd);
+	return 1;
+}
+
+void
+daemonput(char *buf, size_t *len, int tag, const char *s)
+{
+	size_t n = strlen(s) + 1;
+
+	if (n + 1 > DAEMON_MSG_SIZ - *len)
+		die("command and environment too long for the daemon\n");
+	buf[(*len)++] = tag;
+	memcpy(&buf[*len], s, n);
+	*len += n;
+}
+
+void
+daemonlisten(struct sockaddr_un *sa)
+{
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+		die("socket failed: %s\n", strerror(errno));
+	if (bind(fd, (struct sockaddr *)sa, sizeof(*sa)) < 0) {
+		/* nobody answered daemonsend(), so the socket is stale */
+		if (errno != EADDRINUSE || unlink(sa->sun_path) < 0 ||
+		    bind(fd, (struct sockaddr *)sa, sizeof(*sa)) < 0)
+			die("cannot bind %s: %s\n", sa->sun_path,
+			    strerror(errno));
+	}
+	if (listen(fd, 8) < 0)
+		die("cannot listen on %s: %s\n", sa->sun_path, strerror(errno));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	/* run() watches it */
+	daemonwatch.fd = fd;
+}
+
+void
+daemonready(Watch *w, uint32_t events)
+{
+	struct ucred cred;
+	socklen_t len;
+	Watch *c;
+	int fd;
+
+	while ((fd = accept(w->fd, NULL, NULL)) >= 0) {
+		len = sizeof(cred);
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+		    cred.uid != getuid()) {
+			close(fd);
+			continue;
+		}
+		/* the packet follows the connect, daemonclientready gets it */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		c = xmalloc(sizeof(*c));
+		c->fd = fd;
+		c->fn = daemonclientready;
+		watchadd(c, EPOLLIN);
+	}
+}
+
+void
+daemonclientready(Watch *w, uint32_t events)
+{
+	static char buf[DAEMON_MSG_SIZ];
+	char **cmd = opt_cmd, *title = opt_title, **args, **env, *dir = NULL;
+	char *p, *end;
+	Window *nw;
+	ssize_t n;
+	int argc = 0, envc = 0;
+
+	if ((n = recv(w->fd, buf, sizeof(buf) - 1, 0)) < 0 &&
+	    (errno == EAGAIN || errno == EINTR))
+		return;
+	watchdel(w);
+	close(w->fd);
+	free(w);
+	if (n <= 0)
+		return;
+	buf[n] = '\0';
+	end = &buf[n];
+
+	for (p = buf; p < end; p += strlen(p) + 1) {
+		if (*p == 'a')
+			argc++;
+		else if (*p == 'e')
+			envc++;
+	}
+	args = xmalloc((argc + 1) * sizeof(*args));
+	env = xmalloc((envc + 1) * sizeof(*env));
+	opt_title = NULL;
+	for (argc = envc = 0, p = buf; p < end; p += strlen(p) + 1) {
+		switch (*p) {
+		case 'a': args[argc++] = p + 1; break;
+		case 'e': env[envc++] = p + 1; break;
+		case 'd': dir = p + 1; break;
+		case 't': opt_title = p + 1; break;
+		}
+	}
+	args[argc] = env[envc] = NULL;
+
+	opt_dir = dir;
+	opt_env = env;
+	opt_cmd = argc ? args : NULL;
+	/* in a window of its own, active once the compositor focuses it */
+	nw = winnew(MAX(cols, 1), MAX(rows, 1));
+	nw->shown = sessionstart(sessionnew(nw, MAX(cols, 1), MAX(rows, 1)));
+	wlshowtitle();
+	wl_surface_commit(nw->surface);
+	sessionload(active);
+	opt_dir = NULL;
+	opt_env = NULL;
+	opt_cmd = cmd;
+	opt_title = title;
+	free(args);
+	free(env);
+}
+
+void
+pasteend(void)
+{
+	watchdel(&pastewatch);
+	close(pastewatch.fd);
+	pastewatch.fd = -1;
+	if (IS_SET(MODE_BRCKTPASTE))
+		ttywrite("\033[201~", 6);
+}
+
 void
 selclear(void)
 {
-	if (sel.ob.x == -1)
+	/* the selection is the active session's */
+	if (sel.ob.x == -1 || loaded != active)
 		return;
 	sel.mode = SEL_IDLE;
 	sel.ob.x = -1;
@@ -1165,6 +1867,151 @@ wlsetsel(char *str, uint32_t serial)
 	wl_data_device_set_selection(wl.datadev, sel.source, serial);
 }
 
+void
+hintinit(void)
+{
+	if (regcomp(&hintre, hintregex, REG_EXTENDED))
+		die("st: invalid hint regex %s\n", hintregex);
+}
+
+/*
+ * Run the matcher over a single line and cache the result. Only lines
+ * which changed since their last scan are looked at, so entering the
+ * hint mode on a static screen costs nothing.
+ */
+void
+hintscan(int y)
+{
+	static char *buf;
+	static int *bcol, bufsiz;
+	HintLine *hl = &term->hint[y];
+	Glyph *gp;
+	regmatch_t m;
+	int x, len, off, flags, n;
+
+	if (bufsiz < term->col * UTF_SIZ + 1) {
+		bufsiz = term->col * UTF_SIZ + 1;
+		buf = xrealloc(buf, bufsiz);
+		bcol = xrealloc(bcol, bufsiz * sizeof(*bcol));
+	}
+
+	/* encode the line, remembering the column of every byte */
+	for (x = len = 0, gp = term->line[y]; x < term->col; x++, gp++) {
+		if (gp->mode & ATTR_WDUMMY)
+			continue;
+		n = utf8encode(gp->u, buf + len);
+		while (n--)
+			bcol[len++] = x;
+	}
+	buf[len] = '\0';
+
+	hl->n = 0;
+	hl->stale = 0;
+	for (off = 0, flags = 0; off < len; flags = REG_NOTBOL) {
+		if (regexec(&hintre, buf + off, 1, &m, flags))
+			break;
+		if (m.rm_eo == m.rm_so) {
+			off += m.rm_eo + 1;
+			continue;
+		}
+		if (hl->n == hl->siz) {
+			hl->siz = hl->siz ? 2 * hl->siz : 4;
+			hl->h = xrealloc(hl->h, hl->siz * sizeof(*hl->h));
+		}
+		hl->h[hl->n].x1 = bcol[off + m.rm_so];
+		hl->h[hl->n].x2 = bcol[off + m.rm_eo - 1];
+		hl->n++;
+		off += m.rm_eo;
+	}
+}
+
+void
+hintmode(const Arg *dummy)
+{
+	Hints *hs = &active->hints;
+	int y, i, x, nkeys = MIN(strlen(hintkeys), LEN(hs->v));
+	char *ptr;
+	Glyph *gp;
+	Hint *h;
+
+	if (hs->active) {
+		hintleave();
+		return;
+	}
+
+	for (y = 0; y < term->row; y++) {
+		if (term->hint[y].stale || term->dirty[y])
+			hintscan(y);
+		for (i = 0; i < term->hint[y].n && hs->n < nkeys; i++) {
+			h = &term->hint[y].h[i];
+			ptr = hs->v[hs->n].s = xmalloc((h->x2 - h->x1 + 2) * UTF_SIZ);
+			for (x = h->x1, gp = &term->line[y][x]; x <= h->x2; x++, gp++) {
+				if (!(gp->mode & ATTR_WDUMMY))
+					ptr += utf8encode(gp->u, ptr);
+			}
+			*ptr = '\0';
+			hs->v[hs->n].x = h->x1;
+			hs->v[hs->n].y = y;
+			hs->n++;
+		}
+	}
+
+	if (hs->n == 0)
+		return;
+	hs->active = 1;
+	tsetdirt(hs->v[0].y, hs->v[hs->n-1].y);
+}
+
+void
+hintleave(void)
+{
+	Hints *hs = &active->hints;
+	int i;
+
+	if (!hs->active)
+		return;
+	tsetdirt(hs->v[0].y, hs->v[hs->n-1].y);
+	for (i = 0; i < hs->n; i++)
+		free(hs->v[i].s);
+	hs->n = 0;
+	hs->active = 0;
+}
+
+void
+hintkey(xkb_keysym_t ksym, uint32_t serial)
+{
+	Hints *hs = &active->hints;
+	char *p;
+
+	/* modifiers alone neither pick a hint nor cancel */
+	if (BETWEEN(ksym, XKB_KEY_Shift_L, XKB_KEY_Hyper_R)
+			|| BETWEEN(ksym, XKB_KEY_ISO_Lock, XKB_KEY_ISO_Level5_Lock))
+		return;
+
+	if (ksym < 0x80 && ksym != 0 && (p = strchr(hintkeys, ksym))
+			&& p - hintkeys < hs->n) {
+		wlsetsel(hs->v[p - hintkeys].s, serial);
+		/* the selection owns the string now */
+		hs->v[p - hintkeys].s = NULL;
+	}
+	hintleave();
+}
+
+void
+hintdraw(int y)
+{
+	Glyph g = {' ', ATTR_REVERSE|ATTR_BOLD, defaultfg, defaultbg};
+	Hints *hs = &active->hints;
+	int i;
+
+	for (i = 0; i < hs->n; i++) {
+		if (hs->v[i].y != y)
+			continue;
+		g.u = hintkeys[i];
+		wldrawglyph(g, hs->v[i].x, y);
+	}
+}
+
 void
 die(const char *errstr, ...)
 {
@@ -1173,6 +2020,8 @@ die(const char *errstr, ...)
 	va_start(ap, errstr);
 	vfprintf(stderr, errstr, ap);
 	va_end(ap);
+	/* what was printed before the error still goes out */
+	printflush();
 	exit(1);
 }
 
@@ -1181,6 +2030,11 @@ execsh(void)
 {
 	char **args, *sh, *prog;
 	const struct passwd *pw;
+	sigset_t set;
+
+	/* a tab opened by st -d runs in the environment of its st */
+	if (opt_env)
+		environ = opt_env;
 
 	errno = 0;
 	if ((pw = getpwuid(getuid())) == NULL) {
@@ -1210,6 +2064,12 @@ execsh(void)
 	setenv("HOME", pw->pw_dir, 1);
 	setenv("TERM", termname, 1);
 
+	if (opt_dir && chdir(opt_dir) < 0)
+		fprintf(stderr, "chdir %s: %s\n", opt_dir, strerror(errno));
+
+	/* run() blocks SIGCHLD to receive it through a signalfd */
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
 	signal(SIGCHLD, SIG_DFL);
 	signal(SIGHUP, SIG_DFL);
 	signal(SIGINT, SIG_DFL);
@@ -1224,18 +2084,35 @@ execsh(void)
 void
 sigchld(int a)
 {
-	int stat;
-	pid_t p;
-
-	if ((p = waitpid(pid, &stat, WNOHANG)) < 0)
-		die("Waiting for pid %hd failed: %s\n", pid, strerror(errno));
+	int i, live, stat;
+	pid_t p, r;
 
-	if (pid != p)
-		return;
+	for (i = 0, live = 0; i < nsessions; i++)
+		live += !sessions[i]->dead;
+	for (i = 0; i < nsessions; i++) {
+		p = sessions[i]->pid;
+		if (sessions[i]->dead || !p ||
+		    (r = waitpid(p, &stat, WNOHANG)) == 0)
+			continue;
+		if (r < 0)
+			die("Waiting for pid %hd failed: %s\n", p, strerror(errno));
 
-	if (!WIFEXITED(stat) || WEXITSTATUS(stat))
-		die("child finished with error '%d'\n", stat);
-	exit(0);
+		/*
+		 * The other sessions outlive a shell, the last one does not.
+		 * Events for its pty may follow in the same epoll batch, so
+		 * run() frees it once the batch is dispatched.
+		 */
+		if (live > 1) {
+			sessions[i]->dead = 1;
+			live--;
+			continue;
+		}
+		printflush();
+		tracereport();
+		if (!WIFEXITED(stat) || WEXITSTATUS(stat))
+			die("child finished with error '%d'\n", stat);
+		exit(0);
+	}
 }
 
 
@@ -1266,11 +2143,12 @@ stty(void)
 void
 ttynew(void)
 {
-	int m, s;
-	struct winsize w = {term.row, term.col, 0, 0};
+	int m, s, play = opt_replay && nsessions == 1;
+	struct winsize w = {term->row, term->col, 0, 0};
 
-	if (opt_io) {
-		term.mode |= MODE_PRINT;
+	/* only the first session prints to the iofile */
+	if (opt_io && nsessions == 1) {
+		term->mode |= MODE_PRINT;
 		iofd = (!strcmp(opt_io, "-")) ?
 			  1 : open(opt_io, O_WRONLY | O_CREAT, 0666);
 		if (iofd < 0) {
@@ -1278,11 +2156,19 @@ ttynew(void)
 				opt_io, strerror(errno));
 		}
 	}
+	if (opt_rec && nsessions == 1) {
+		recfd = open(opt_rec, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (recfd < 0) {
+			fprintf(stderr, "Error opening %s:%s\n",
+				opt_rec, strerror(errno));
+		}
+		loaded->record = 1;
+	}
 
 	if (opt_line) {
-		if ((cmdfd = open(opt_line, O_RDWR)) < 0)
+		if ((loaded->cmdfd = open(opt_line, O_RDWR)) < 0)
 			die("open line failed: %s\n", strerror(errno));
-		dup2(cmdfd, 0);
+		dup2(loaded->cmdfd, 0);
 		stty();
 		return;
 	}
@@ -1290,27 +2176,34 @@ ttynew(void)
 	/* seems to work fine on linux, openbsd and freebsd */
 	if (openpty(&m, &s, NULL, NULL, &w) < 0)
 		die("openpty failed: %s\n", strerror(errno));
+	/* the shells of the other sessions must not get hold of it */
+	fcntl(m, F_SETFD, FD_CLOEXEC);
 
-	switch (pid = fork()) {
+	switch (loaded->pid = fork()) {
 	case -1:
 		die("fork failed\n");
 		break;
 	case 0:
 		close(iofd);
+		close(recfd);
+		printlen = 0;
 		setsid(); /* create a new process group */
 		dup2(s, 0);
 		dup2(s, 1);
-		dup2(s, 2);
+		/* a replay reports on st's own stderr */
+		if (!play)
+			dup2(s, 2);
 		if (ioctl(s, TIOCSCTTY, NULL) < 0)
 			die("ioctl TIOCSCTTY failed: %s\n", strerror(errno));
 		close(s);
 		close(m);
+		if (play)
+			replay();
 		execsh();
 		break;
 	default:
 		close(s);
-		cmdfd = m;
-		signal(SIGCHLD, sigchld);
+		loaded->cmdfd = m;
 		break;
 	}
 }
@@ -1319,77 +2212,205 @@ size_t
 ttyread(void)
 {
 	static char buf[BUFSIZ];
-	static int buflen = 0;
-	char *ptr;
-	int charsize; /* size of utf8 char in bytes */
-	Rune unicodep;
+	int buflen = loaded->nrest;
+	int written, print;
 	int ret;
 
 	/* append read bytes to unprocessed bytes */
-	if ((ret = read(cmdfd, buf+buflen, LEN(buf)-buflen)) < 0)
-		die("Couldn't read from shell: %s\n", strerror(errno));
+	memcpy(buf, loaded->rest, buflen);
+	if ((ret = read(loaded->cmdfd, buf+buflen, LEN(buf)-buflen)) <= 0) {
+		/*
+		 * cmdfd is non-blocking and edge triggered: keep going until
+		 * it is drained. EIO means the slave side was closed; the
+		 * child is exiting and its SIGCHLD follows.
+		 */
+		if (ret == 0 || errno == EAGAIN || (errno == EIO && loaded->pid))
+			loaded->pending = 0;
+		else if (errno != EINTR)
+			die("Couldn't read from shell: %s\n", strerror(errno));
+		return 0;
+	}
 
 	buflen += ret;
-	ptr = buf;
-
-	for (;;) {
-		if (IS_SET(MODE_UTF8) && !IS_SET(MODE_SIXEL)) {
-			/* process a complete utf8 char */
-			charsize = utf8decode(ptr, &unicodep, buflen);
-			if (charsize == 0)
-				break;
-			tputc(unicodep);
-			ptr += charsize;
-			buflen -= charsize;
-
-		} else {
-			if (buflen <= 0)
-				break;
-			tputc(*ptr++ & 0xFF);
-			buflen--;
-		}
-	}
+	if (loaded == active && latset(&keylat.t[LAT_SEND]))
+		latstamp(LAT_ECHO);
+	if (loaded->record && recfd != -1)
+		ttyrecord(buf + buflen - ret, ret);
+	/*
+	 * The bytes as read, with one copy per read. A read that turns
+	 * printing on or off is not cut at the switch, it is left out.
+	 */
+	print = printraw && IS_SET(MODE_PRINT);
+	written = twrite(buf, buflen);
+	if (print && IS_SET(MODE_PRINT))
+		tprinter(buf, written);
 	/* keep any uncomplete utf8 char for the next call */
-	if (buflen > 0)
-		memmove(buf, ptr, buflen);
+	loaded->nrest = buflen - written;
+	memcpy(loaded->rest, buf + written, loaded->nrest);
 
-	needdraw = true;
+	/* keep the cursor shown while output streams in */
+	cursorblinkreset();
+	win->needdraw = true;
 	return ret;
 }
 
+/*
+ * The input is recorded as read, in the ttyrec format: every read is
+ * a little endian header of seconds, microseconds and length, then the
+ * bytes. The time is monotonic from st's start.
+ */
 void
-ttywrite(const char *s, size_t n)
+ttyrecord(const char *s, size_t n)
 {
-	fd_set wfd, rfd;
+	struct timespec now;
+	unsigned char h[12];
+	uint32_t v[3];
+	struct iovec iov[2], *iv = iov;
 	ssize_t r;
-	size_t lim = 256;
+	int i, cnt = 2;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now.tv_sec -= starttime.tv_sec;
+	now.tv_nsec -= starttime.tv_nsec;
+	if (now.tv_nsec < 0) {
+		now.tv_sec--;
+		now.tv_nsec += 1000000000;
+	}
+	v[0] = now.tv_sec;
+	v[1] = now.tv_nsec / 1000;
+	v[2] = n;
+	for (i = 0; i < 12; i++)
+		h[i] = v[i / 4] >> 8 * (i % 4);
+
+	/* header and data in one call, a short write is finished after */
+	iov[0].iov_base = h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = (char *)s;
+	iov[1].iov_len = n;
+	while (cnt > 0) {
+		if ((r = writev(recfd, iv, cnt)) < 0) {
+			fprintf(stderr, "Error writing in %s:%s\n",
+				opt_rec, strerror(errno));
+			close(recfd);
+			recfd = -1;
+			return;
+		}
+		for (; cnt > 0 && r >= iv->iov_len; iv++, cnt--)
+			r -= iv->iov_len;
+		if (cnt > 0) {
+			iv->iov_base = (char *)iv->iov_base + r;
+			iv->iov_len -= r;
+		}
+	}
+}
 
-	/*
-	 * Remember that we are using a pty, which might be a modem line.
-	 * Writing too much will clog the line. That's why we are doing this
+/*
+ * Runs in the child in place of the shell and writes a recording back
+ * to the pty, so that it goes through ttyread() like the original did.
+ * The terminal is asked for its attributes at the end: the answer comes
+ * once everything before it was parsed.
+ */
+void
+replay(void)
+{
+	struct termios tio;
+	struct timespec start, now, at;
+	unsigned char h[12];
+	uint32_t v[3];
+	char *buf = NULL, c;
+	size_t total = 0;
+	long long base = -1, us;
+	FILE *f;
+	int i;
+
+	if (!(f = fopen(opt_replay, "r")))
+		die("open %s failed: %s\n", opt_replay, strerror(errno));
+	/* the recording has been through the line discipline already */
+	tcgetattr(1, &tio);
+	tio.c_iflag &= ~(ICRNL | IXON);
+	tio.c_oflag &= ~OPOST;
+	tio.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	tcsetattr(1, TCSANOW, &tio);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (fread(h, 1, sizeof(h), f) == sizeof(h)) {
+		for (i = 0; i < 3; i++) {
+			v[i] = h[4*i] | h[4*i+1] << 8 | h[4*i+2] << 16 |
+			       (uint32_t)h[4*i+3] << 24;
+		}
+		buf = xrealloc(buf, v[2]);
+		if (fread(buf, 1, v[2], f) != v[2])
+			break;
+		us = v[0] * 1000000LL + v[1];
+		if (base < 0)
+			base = us;
+		if (!opt_replayfast && us > base) {
+			at.tv_sec = start.tv_sec + (us - base) / 1000000;
+			at.tv_nsec = start.tv_nsec + (us - base) % 1000000 * 1000;
+			if (at.tv_nsec >= 1000000000) {
+				at.tv_sec++;
+				at.tv_nsec -= 1000000000;
+			}
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			                       &at, NULL) == EINTR)
+				;
+		}
+		if (xwrite(1, buf, v[2]) < 0)
+			_exit(1);
+		total += v[2];
+	}
+
+	tcflush(0, TCIFLUSH);
+	if (xwrite(1, "\033[c", 3) < 0)
+		_exit(1);
+	while (read(0, &c, 1) == 1 && c != 'c')
+		;
+	if (opt_trace) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		fprintf(stderr, "st: replay: %zu bytes in %.3f ms\n", total,
+		        (now.tv_sec - start.tv_sec) * 1e3 +
+		        (now.tv_nsec - start.tv_nsec) / 1e6);
+	}
+	_exit(0);
+}
+
+void
+ttywrite(const char *s, size_t n)
+{
+	struct pollfd pfd = {
+		.fd = loaded->cmdfd, .events = POLLIN | POLLOUT
+	};
+	ssize_t r;
+	size_t lim = TTY_WRITE_MIN;
+
+	/*
+	 * Remember that we are using a pty, which might be a modem line.
+	 * Writing too much will clog the line. That's why we are doing this
 	 * dance.
 	 * FIXME: Migrate the world to Plan 9.
 	 */
 	while (n > 0) {
-		FD_ZERO(&wfd);
-		FD_ZERO(&rfd);
-		FD_SET(cmdfd, &wfd);
-		FD_SET(cmdfd, &rfd);
-
 		/* Check if we can write. */
-		if (pselect(cmdfd+1, &rfd, &wfd, NULL, NULL, NULL) < 0) {
+		if (poll(&pfd, 1, -1) < 0) {
 			if (errno == EINTR)
 				continue;
-			die("select failed: %s\n", strerror(errno));
+			die("poll failed: %s\n", strerror(errno));
 		}
-		if (FD_ISSET(cmdfd, &wfd)) {
+		if (pfd.revents & POLLOUT) {
 			/*
-			 * Only write the bytes written by ttywrite() or the
-			 * default of 256. This seems to be a reasonable value
-			 * for a serial line. Bigger values might clog the I/O.
+			 * Only write the bytes read by ttyread() or at least
+			 * TTY_WRITE_MIN, which ttyread() returning nothing on
+			 * an idle pty must not shrink. This seems to be a
+			 * reasonable value for a serial line. Bigger values
+			 * might clog the I/O.
 			 */
-			if ((r = write(cmdfd, s, (n < lim)? n : lim)) < 0)
-				goto write_error;
+			if ((r = write(loaded->cmdfd, s, (n < lim)? n : lim)) < 0) {
+				if (errno != EAGAIN && errno != EINTR)
+					goto write_error;
+				r = 0;
+			}
 			if (r < n) {
 				/*
 				 * We weren't able to write out everything.
@@ -1397,7 +2418,7 @@ ttywrite(const char *s, size_t n)
 				 * again. Empty it.
 				 */
 				if (n < lim)
-					lim = ttyread();
+					lim = MAX(ttyread(), TTY_WRITE_MIN);
 				n -= r;
 				s += r;
 			} else {
@@ -1405,8 +2426,8 @@ ttywrite(const char *s, size_t n)
 				break;
 			}
 		}
-		if (FD_ISSET(cmdfd, &rfd))
-			lim = ttyread();
+		if (pfd.revents & (POLLIN | POLLHUP))
+			lim = MAX(ttyread(), TTY_WRITE_MIN);
 	}
 	return;
 
@@ -1421,6 +2442,7 @@ ttysend(char *s, size_t n)
 	char *t, *lim;
 	Rune u;
 
+	latstamp(LAT_SEND);
 	ttywrite(s, n);
 	if (!IS_SET(MODE_ECHO))
 		return;
@@ -1445,75 +2467,317 @@ ttyresize(void)
 {
 	struct winsize w;
 
-	w.ws_row = term.row;
-	w.ws_col = term.col;
-	w.ws_xpixel = wl.tw;
-	w.ws_ypixel = wl.th;
-	if (ioctl(cmdfd, TIOCSWINSZ, &w) < 0)
+	w.ws_row = term->row;
+	w.ws_col = term->col;
+	w.ws_xpixel = win->tw;
+	w.ws_ypixel = win->th;
+	if (ioctl(loaded->cmdfd, TIOCSWINSZ, &w) < 0)
 		fprintf(stderr, "Couldn't set window size: %s\n", strerror(errno));
 }
 
-int
-tattrset(int attr)
+/* a session in w with a col x row terminal and no shell yet, loaded */
+Session *
+sessionnew(Window *w, int col, int row)
+{
+	Session *s = xmalloc(sizeof(*s));
+
+	memset(s, 0, sizeof(*s));
+	s->watch.fn = ttyready;
+	s->win = w;
+	s->title = xstrdup(opt_title ? opt_title : "st");
+	sessions = xrealloc(sessions, ++nsessions * sizeof(*sessions));
+	sessions[nsessions-1] = s;
+	sessionload(s);
+	tnew(col, row);
+	return s;
+}
+
+/* start the shell of a session made by sessionnew() */
+Session *
+sessionstart(Session *s)
+{
+	sessionload(s);
+	ttynew();
+	ttyresize();
+
+	fcntl(s->cmdfd, F_SETFL, fcntl(s->cmdfd, F_GETFL) | O_NONBLOCK);
+	s->watch.fd = s->cmdfd;
+	watchadd(&s->watch, EPOLLIN | EPOLLET);
+	s->pending = 1;
+	return s;
+}
+
+void
+sessionload(Session *s)
+{
+	int col, row;
+
+	if (s == loaded)
+		return;
+	term = &s->term;
+	csiescseq = &s->csi;
+	strescseq = &s->str;
+	osc52 = &s->osc52;
+	sixel = &s->sixel;
+	loaded = s;
+	win = s->win;
+
+	/* the window may have been resized while the session was away */
+	if (!term->line || !wl.cw)
+		return;
+	col = win->tw / wl.cw;
+	row = win->th / wl.ch;
+	if (col != term->col || row != term->row) {
+		tresize(col, row);
+		ttyresize();
+	}
+}
+
+void
+sessionswitch(Session *s)
+{
+	if (active) {
+		sessionload(active);
+		if (pastewatch.fd >= 0)
+			pasteend();
+		hintleave();
+		selclear();
+	}
+
+	sessionload(s);
+	active = s;
+	/* another tab, or just the focus moving to another window */
+	if (win->shown != s) {
+		win->shown = s;
+		tfulldirt();
+	}
+	/* synctimer only runs for the active session's update */
+	if (IS_SET(MODE_SYNC))
+		timerset(&synctimer, synctimeout);
+	else
+		timerstop(&synctimer);
+	if (blinktimeout && !blinktimer.idx)
+		timerset(&blinktimer, blinktimeout);
+	cursorblinkreset();
+	wlshowtitle();
+}
+
+void
+sessionclose(Session *s)
 {
+	Session *next;
+	Window *w;
 	int i, j;
 
-	for (i = 0; i < term.row-1; i++) {
-		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr)
-				return 1;
+	sessionload(s);
+	watchdel(&s->watch);
+	close(s->cmdfd);
+	if (s == active) {
+		/* nobody is left to read the end of a paste */
+		if (pastewatch.fd >= 0) {
+			watchdel(&pastewatch);
+			close(pastewatch.fd);
+			pastewatch.fd = -1;
 		}
+		hintleave();
+		selclear();
 	}
 
-	return 0;
+	for (i = 0; i < term->row; i++) {
+		imgunref(term->line[i], term->col);
+		imgunref(term->alt[i], term->col);
+		free(term->line[i]);
+		free(term->alt[i]);
+		free(term->hint[i].h);
+	}
+	free(term->line);
+	free(term->alt);
+	free(term->dirty);
+	free(term->blink);
+	free(term->altblink);
+	free(term->hint);
+	free(term->tabs);
+	free(strescseq->buf);
+	free(osc52->buf);
+	free(sixel->px);
+	free(s->title);
+	if (printer == s)
+		printflush();
+
+	for (i = 0; sessions[i] != s; i++)
+		;
+	memmove(&sessions[i], &sessions[i+1],
+	        (--nsessions - i) * sizeof(*sessions));
+	loaded = NULL;
+
+	/* the window shows the next of its sessions, or goes with the last */
+	w = s->win;
+	for (j = i; j < nsessions && sessions[j]->win != w; j++)
+		;
+	if (j == nsessions) {
+		for (j = i - 1; j >= 0 && sessions[j]->win != w; j--)
+			;
+	}
+	next = (j >= 0) ? sessions[j] : NULL;
+	if (!next) {
+		if (w->surface)
+			winclose(w);
+		free(w);
+	} else if (w->shown == s) {
+		w->shown = next;
+		sessionload(next);
+		tfulldirt();
+	}
+
+	if (s == active) {
+		active = NULL;
+		sessionswitch(next ? next : windows[0]->shown);
+	} else {
+		if (next && w->surface) {
+			sessionload(w->shown);
+			wlshowtitle();
+		}
+		sessionload(active);
+	}
+	free(s);
 }
 
+/* a new window for col x row cells, drawn once it is configured */
+Window *
+winnew(int col, int row)
+{
+	Window *w = xmalloc(sizeof(*w));
+
+	memset(w, 0, sizeof(*w));
+	w->tw = col * wl.cw;
+	w->th = row * wl.ch;
+	w->h = 2 * borderpx + w->th;
+	w->w = 2 * borderpx + w->tw;
+	/* until it leaves every output, see surfleave() */
+	w->state = WIN_VISIBLE;
+	windows = xrealloc(windows, ++nwindows * sizeof(*windows));
+	windows[nwindows-1] = w;
+
+	w->surface = wl_compositor_create_surface(wl.cmp);
+	wl_surface_add_listener(w->surface, &surflistener, w);
+	w->xdgsurface = xdg_wm_base_get_xdg_surface(wl.wm, w->surface);
+	xdg_surface_add_listener(w->xdgsurface, &xdgsurflistener, w);
+	w->toplevel = xdg_surface_get_toplevel(w->xdgsurface);
+	xdg_toplevel_add_listener(w->toplevel, &toplevellistener, w);
+	xdg_toplevel_set_app_id(w->toplevel, opt_class ? opt_class : termname);
+	return w;
+}
+
+/*
+ * Take a window off the display. Its sessions keep it until they are
+ * closed. Closing the last window hangs up every shell and ends st.
+ */
 void
-tsetdirt(int top, int bot)
+winclose(Window *w)
 {
 	int i;
 
-	LIMIT(top, 0, term.row-1);
-	LIMIT(bot, 0, term.row-1);
+	for (i = 0; windows[i] != w; i++)
+		;
+	memmove(&windows[i], &windows[i+1],
+	        (--nwindows - i) * sizeof(*windows));
+	if (nwindows == 0) {
+		for (i = 0; i < nsessions; i++)
+			kill(sessions[i]->pid, SIGHUP);
+		printflush();
+		tracereport();
+		exit(0);
+	}
 
-	for (i = top; i <= bot; i++)
-		term.dirty[i] = 1;
+	if (w->framecb)
+		wl_callback_destroy(w->framecb);
+	xdg_toplevel_destroy(w->toplevel);
+	xdg_surface_destroy(w->xdgsurface);
+	wl_surface_destroy(w->surface);
+	if (w->oldbuffer)
+		wld_buffer_unreference(w->oldbuffer);
+	if (w->buffer)
+		wld_buffer_unreference(w->buffer);
+	w->surface = NULL;
+	w->xdgsurface = NULL;
+	w->toplevel = NULL;
+	w->framecb = NULL;
+	w->buffer = w->oldbuffer = NULL;
+	w->state = 0;
+	if (wl.pointed == w)
+		wl.pointed = NULL;
+}
+
+/* draw a window that waits for it, once the last frame was shown */
+void
+windraw(Window *w)
+{
+	if (!w->needdraw || !(w->state & WIN_VISIBLE) || w->framecb ||
+	    !w->configured)
+		return;
+	sessionload(w->shown);
+	/* a synchronized update is drawn once it is complete */
+	if (!(w->shown == active && IS_SET(MODE_SYNC) && synctimer.idx))
+		draw();
+	sessionload(active);
+}
 
-	needdraw = true;
+void
+newsession(const Arg *dummy)
+{
+	/* a serial line cannot be shared */
+	if (opt_line)
+		return;
+	sessionswitch(sessionstart(sessionnew(win, term->col, term->row)));
 }
 
 void
-tsetdirtattr(int attr)
+cyclesession(const Arg *arg)
 {
-	int i, j;
+	int i, n, step = (arg->i > 0) ? 1 : -1;
 
-	for (i = 0; i < term.row-1; i++) {
-		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr) {
-				tsetdirt(i, i);
-				break;
-			}
-		}
+	for (i = 0; sessions[i] != active; i++)
+		;
+	/* through the sessions of the window only */
+	for (n = arg->i; n != 0; n -= step) {
+		do
+			i = (i + step + nsessions) % nsessions;
+		while (sessions[i]->win != win);
 	}
+	if (sessions[i] != active)
+		sessionswitch(sessions[i]);
+}
+
+void
+tsetdirt(int top, int bot)
+{
+	int i;
+
+	LIMIT(top, 0, term->row-1);
+	LIMIT(bot, 0, term->row-1);
+
+	for (i = top; i <= bot; i++)
+		term->dirty[i] = 1;
+
+	win->needdraw = true;
 }
 
 void
 tfulldirt(void)
 {
-	tsetdirt(0, term.row-1);
+	tsetdirt(0, term->row-1);
 }
 
 void
 tcursor(int mode)
 {
-	static TCursor c[2];
 	int alt = IS_SET(MODE_ALTSCREEN);
 
 	if (mode == CURSOR_SAVE) {
-		c[alt] = term.c;
+		term->saved[alt] = term->c;
 	} else if (mode == CURSOR_LOAD) {
-		term.c = c[alt];
-		tmoveto(c[alt].x, c[alt].y);
+		term->c = term->saved[alt];
+		tmoveto(term->saved[alt].x, term->saved[alt].y);
 	}
 }
 
@@ -1522,25 +2786,25 @@ treset(void)
 {
 	uint i;
 
-	term.c = (TCursor){{
+	term->c = (TCursor){{
 		.mode = ATTR_NULL,
 		.fg = defaultfg,
 		.bg = defaultbg
 	}, .x = 0, .y = 0, .state = CURSOR_DEFAULT};
 
-	memset(term.tabs, 0, term.col * sizeof(*term.tabs));
-	for (i = tabspaces; i < term.col; i += tabspaces)
-		term.tabs[i] = 1;
-	term.top = 0;
-	term.bot = term.row - 1;
-	term.mode = MODE_WRAP|MODE_UTF8;
-	memset(term.trantbl, CS_USA, sizeof(term.trantbl));
-	term.charset = 0;
+	memset(term->tabs, 0, term->col * sizeof(*term->tabs));
+	for (i = tabspaces; i < term->col; i += tabspaces)
+		term->tabs[i] = 1;
+	term->top = 0;
+	term->bot = term->row - 1;
+	term->mode = MODE_WRAP|MODE_UTF8;
+	memset(term->trantbl, CS_USA, sizeof(term->trantbl));
+	term->charset = 0;
 
 	for (i = 0; i < 2; i++) {
 		tmoveto(0, 0);
 		tcursor(CURSOR_SAVE);
-		tclearregion(0, 0, term.col-1, term.row-1);
+		tclearregion(0, 0, term->col-1, term->row-1);
 		tswapscreen();
 	}
 }
@@ -1548,9 +2812,12 @@ treset(void)
 void
 tnew(int col, int row)
 {
-	term = (Term){ .c = { .attr = { .fg = defaultfg, .bg = defaultbg } } };
+	*term = (Term){
+		.c = { .attr = { .fg = defaultfg, .bg = defaultbg } },
+		.cursor = cursorshape,
+	};
 	tresize(col, row);
-	term.numlock = 1;
+	term->numlock = 1;
 
 	treset();
 }
@@ -1558,29 +2825,38 @@ tnew(int col, int row)
 void
 tswapscreen(void)
 {
-	Line *tmp = term.line;
+	Line *tmp = term->line;
+	int *btmp = term->blink;
 
-	term.line = term.alt;
-	term.alt = tmp;
-	term.mode ^= MODE_ALTSCREEN;
+	term->line = term->alt;
+	term->alt = tmp;
+	term->blink = term->altblink;
+	term->altblink = btmp;
+	term->mode ^= MODE_ALTSCREEN;
 	tfulldirt();
+	/* the other screen may hold blinking glyphs */
+	if (blinktimeout && !blinktimer.idx && loaded == active)
+		timerset(&blinktimer, blinktimeout);
 }
 
 void
 tscrolldown(int orig, int n)
 {
-	int i;
+	int i, b;
 	Line temp;
 
-	LIMIT(n, 0, term.bot-orig+1);
+	LIMIT(n, 0, term->bot-orig+1);
 
-	tsetdirt(orig, term.bot-n);
-	tclearregion(0, term.bot-n+1, term.col-1, term.bot);
+	tsetdirt(orig, term->bot-n);
+	tclearregion(0, term->bot-n+1, term->col-1, term->bot);
 
-	for (i = term.bot; i >= orig+n; i--) {
-		temp = term.line[i];
-		term.line[i] = term.line[i-n];
-		term.line[i-n] = temp;
+	for (i = term->bot; i >= orig+n; i--) {
+		temp = term->line[i];
+		term->line[i] = term->line[i-n];
+		term->line[i-n] = temp;
+		b = term->blink[i];
+		term->blink[i] = term->blink[i-n];
+		term->blink[i-n] = b;
 	}
 
 	selscroll(orig, n);
@@ -1589,18 +2865,21 @@ tscrolldown(int orig, int n)
 void
 tscrollup(int orig, int n)
 {
-	int i;
+	int i, b;
 	Line temp;
 
-	LIMIT(n, 0, term.bot-orig+1);
+	LIMIT(n, 0, term->bot-orig+1);
 
-	tclearregion(0, orig, term.col-1, orig+n-1);
-	tsetdirt(orig+n, term.bot);
+	tclearregion(0, orig, term->col-1, orig+n-1);
+	tsetdirt(orig+n, term->bot);
 
-	for (i = orig; i <= term.bot-n; i++) {
-		temp = term.line[i];
-		term.line[i] = term.line[i+n];
-		term.line[i+n] = temp;
+	for (i = orig; i <= term->bot-n; i++) {
+		temp = term->line[i];
+		term->line[i] = term->line[i+n];
+		term->line[i+n] = temp;
+		b = term->blink[i];
+		term->blink[i] = term->blink[i+n];
+		term->blink[i+n] = b;
 	}
 
 	selscroll(orig, -n);
@@ -1609,27 +2888,27 @@ tscrollup(int orig, int n)
 void
 selscroll(int orig, int n)
 {
-	if (sel.ob.x == -1)
+	if (sel.ob.x == -1 || loaded != active)
 		return;
 
-	if (BETWEEN(sel.ob.y, orig, term.bot) || BETWEEN(sel.oe.y, orig, term.bot)) {
-		if ((sel.ob.y += n) > term.bot || (sel.oe.y += n) < term.top) {
+	if (BETWEEN(sel.ob.y, orig, term->bot) || BETWEEN(sel.oe.y, orig, term->bot)) {
+		if ((sel.ob.y += n) > term->bot || (sel.oe.y += n) < term->top) {
 			selclear();
 			return;
 		}
 		if (sel.type == SEL_RECTANGULAR) {
-			if (sel.ob.y < term.top)
-				sel.ob.y = term.top;
-			if (sel.oe.y > term.bot)
-				sel.oe.y = term.bot;
+			if (sel.ob.y < term->top)
+				sel.ob.y = term->top;
+			if (sel.oe.y > term->bot)
+				sel.oe.y = term->bot;
 		} else {
-			if (sel.ob.y < term.top) {
-				sel.ob.y = term.top;
+			if (sel.ob.y < term->top) {
+				sel.ob.y = term->top;
 				sel.ob.x = 0;
 			}
-			if (sel.oe.y > term.bot) {
-				sel.oe.y = term.bot;
-				sel.oe.x = term.col;
+			if (sel.oe.y > term->bot) {
+				sel.oe.y = term->bot;
+				sel.oe.x = term->col;
 			}
 		}
 		selnormalize();
@@ -1639,51 +2918,51 @@ selscroll(int orig, int n)
 void
 tnewline(int first_col)
 {
-	int y = term.c.y;
+	int y = term->c.y;
 
-	if (y == term.bot) {
-		tscrollup(term.top, 1);
+	if (y == term->bot) {
+		tscrollup(term->top, 1);
 	} else {
 		y++;
 	}
-	tmoveto(first_col ? 0 : term.c.x, y);
+	tmoveto(first_col ? 0 : term->c.x, y);
 }
 
 void
 csiparse(void)
 {
-	char *p = csiescseq.buf, *np;
+	char *p = csiescseq->buf, *np;
 	long int v;
 
-	csiescseq.narg = 0;
+	csiescseq->narg = 0;
 	if (*p == '?') {
-		csiescseq.priv = 1;
+		csiescseq->priv = 1;
 		p++;
 	}
 
-	csiescseq.buf[csiescseq.len] = '\0';
-	while (p < csiescseq.buf+csiescseq.len) {
+	csiescseq->buf[csiescseq->len] = '\0';
+	while (p < csiescseq->buf+csiescseq->len) {
 		np = NULL;
 		v = strtol(p, &np, 10);
 		if (np == p)
 			v = 0;
 		if (v == LONG_MAX || v == LONG_MIN)
 			v = -1;
-		csiescseq.arg[csiescseq.narg++] = v;
+		csiescseq->arg[csiescseq->narg++] = v;
 		p = np;
-		if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ)
+		if (*p != ';' || csiescseq->narg == ESC_ARG_SIZ)
 			break;
 		p++;
 	}
-	csiescseq.mode[0] = *p++;
-	csiescseq.mode[1] = (p < csiescseq.buf+csiescseq.len) ? *p : '\0';
+	csiescseq->mode[0] = *p++;
+	csiescseq->mode[1] = (p < csiescseq->buf+csiescseq->len) ? *p : '\0';
 }
 
 /* for absolute user moves, when decom is set */
 void
 tmoveato(int x, int y)
 {
-	tmoveto(x, y + ((term.c.state & CURSOR_ORIGIN) ? term.top: 0));
+	tmoveto(x, y + ((term->c.state & CURSOR_ORIGIN) ? term->top: 0));
 }
 
 void
@@ -1691,16 +2970,16 @@ tmoveto(int x, int y)
 {
 	int miny, maxy;
 
-	if (term.c.state & CURSOR_ORIGIN) {
-		miny = term.top;
-		maxy = term.bot;
+	if (term->c.state & CURSOR_ORIGIN) {
+		miny = term->top;
+		maxy = term->bot;
 	} else {
 		miny = 0;
-		maxy = term.row - 1;
+		maxy = term->row - 1;
 	}
-	term.c.state &= ~CURSOR_WRAPNEXT;
-	term.c.x = LIMIT(x, 0, term.col-1);
-	term.c.y = LIMIT(y, miny, maxy);
+	term->c.state &= ~CURSOR_WRAPNEXT;
+	term->c.x = LIMIT(x, 0, term->col-1);
+	term->c.y = LIMIT(y, miny, maxy);
 }
 
 void
@@ -1720,23 +2999,32 @@ tsetchar(Rune u, Glyph *attr, int x, int y)
 	/*
 	 * The table is proudly stolen from rxvt.
 	 */
-	if (term.trantbl[term.charset] == CS_GRAPHIC0 &&
+	if (term->trantbl[term->charset] == CS_GRAPHIC0 &&
 	   BETWEEN(u, 0x41, 0x7e) && vt100_0[u - 0x41])
 		utf8decode(vt100_0[u - 0x41], &u, UTF_SIZ);
 
-	if (term.line[y][x].mode & ATTR_WIDE) {
-		if (x+1 < term.col) {
-			term.line[y][x+1].u = ' ';
-			term.line[y][x+1].mode &= ~ATTR_WDUMMY;
+	if (term->line[y][x].mode & ATTR_WIDE) {
+		if (x+1 < term->col) {
+			term->line[y][x+1].u = ' ';
+			term->line[y][x+1].mode &= ~ATTR_WDUMMY;
 		}
-	} else if (term.line[y][x].mode & ATTR_WDUMMY) {
-		term.line[y][x-1].u = ' ';
-		term.line[y][x-1].mode &= ~ATTR_WIDE;
+	} else if (term->line[y][x].mode & ATTR_WDUMMY) {
+		term->line[y][x-1].u = ' ';
+		term->line[y][x-1].mode &= ~ATTR_WIDE;
 	}
 
-	term.dirty[y] = 1;
-	term.line[y][x] = *attr;
-	term.line[y][x].u = u;
+	imgunref(&term->line[y][x], 1);
+	term->dirty[y] = 1;
+	term->line[y][x] = *attr;
+	term->line[y][x].u = u;
+	imgref(&term->line[y][x], 1);
+
+	if (attr->mode & ATTR_BLINK) {
+		term->blink[y] = 1;
+		/* sessionswitch() starts it for the others */
+		if (blinktimeout && !blinktimer.idx && loaded == active)
+			timerset(&blinktimer, blinktimeout);
+	}
 }
 
 void
@@ -1750,19 +3038,22 @@ tclearregion(int x1, int y1, int x2, int y2)
 	if (y1 > y2)
 		temp = y1, y1 = y2, y2 = temp;
 
-	LIMIT(x1, 0, term.col-1);
-	LIMIT(x2, 0, term.col-1);
-	LIMIT(y1, 0, term.row-1);
-	LIMIT(y2, 0, term.row-1);
+	LIMIT(x1, 0, term->col-1);
+	LIMIT(x2, 0, term->col-1);
+	LIMIT(y1, 0, term->row-1);
+	LIMIT(y2, 0, term->row-1);
 
 	for (y = y1; y <= y2; y++) {
-		term.dirty[y] = 1;
+		term->dirty[y] = 1;
+		if (x1 == 0 && x2 == term->col-1)
+			term->blink[y] = 0;
 		for (x = x1; x <= x2; x++) {
-			gp = &term.line[y][x];
+			gp = &term->line[y][x];
 			if (selected(x, y))
 				selclear();
-			gp->fg = term.c.attr.fg;
-			gp->bg = term.c.attr.bg;
+			imgunref(gp, 1);
+			gp->fg = term->c.attr.fg;
+			gp->bg = term->c.attr.bg;
 			gp->mode = 0;
 			gp->u = ' ';
 		}
@@ -1775,15 +3066,18 @@ tdeletechar(int n)
 	int dst, src, size;
 	Glyph *line;
 
-	LIMIT(n, 0, term.col - term.c.x);
+	LIMIT(n, 0, term->col - term->c.x);
 
-	dst = term.c.x;
-	src = term.c.x + n;
-	size = term.col - src;
-	line = term.line[term.c.y];
+	dst = term->c.x;
+	src = term->c.x + n;
+	size = term->col - src;
+	line = term->line[term->c.y];
 
+	/* the deleted cells go, the copies left at the end are cleared */
+	imgunref(&line[dst], n);
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
-	tclearregion(term.col-n, term.c.y, term.col-1, term.c.y);
+	imgref(&line[term->col-n], n);
+	tclearregion(term->col-n, term->c.y, term->col-1, term->c.y);
 }
 
 void
@@ -1792,29 +3086,32 @@ tinsertblank(int n)
 	int dst, src, size;
 	Glyph *line;
 
-	LIMIT(n, 0, term.col - term.c.x);
+	LIMIT(n, 0, term->col - term->c.x);
 
-	dst = term.c.x + n;
-	src = term.c.x;
-	size = term.col - dst;
-	line = term.line[term.c.y];
+	dst = term->c.x + n;
+	src = term->c.x;
+	size = term->col - dst;
+	line = term->line[term->c.y];
 
+	/* the cells pushed off go, the copies left behind are cleared */
+	imgunref(&line[term->col-n], n);
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
-	tclearregion(src, term.c.y, dst - 1, term.c.y);
+	imgref(&line[src], n);
+	tclearregion(src, term->c.y, dst - 1, term->c.y);
 }
 
 void
 tinsertblankline(int n)
 {
-	if (BETWEEN(term.c.y, term.top, term.bot))
-		tscrolldown(term.c.y, n);
+	if (BETWEEN(term->c.y, term->top, term->bot))
+		tscrolldown(term->c.y, n);
 }
 
 void
 tdeleteline(int n)
 {
-	if (BETWEEN(term.c.y, term.top, term.bot))
-		tscrollup(term.c.y, n);
+	if (BETWEEN(term->c.y, term->top, term->bot))
+		tscrollup(term->c.y, n);
 }
 
 int32_t
@@ -1876,7 +3173,7 @@ tsetattr(int *attr, int l)
 	for (i = 0; i < l; i++) {
 		switch (attr[i]) {
 		case 0:
-			term.c.attr.mode &= ~(
+			term->c.attr.mode &= ~(
 				ATTR_BOLD       |
 				ATTR_FAINT      |
 				ATTR_ITALIC     |
@@ -1885,79 +3182,79 @@ tsetattr(int *attr, int l)
 				ATTR_REVERSE    |
 				ATTR_INVISIBLE  |
 				ATTR_STRUCK     );
-			term.c.attr.fg = defaultfg;
-			term.c.attr.bg = defaultbg;
+			term->c.attr.fg = defaultfg;
+			term->c.attr.bg = defaultbg;
 			break;
 		case 1:
-			term.c.attr.mode |= ATTR_BOLD;
+			term->c.attr.mode |= ATTR_BOLD;
 			break;
 		case 2:
-			term.c.attr.mode |= ATTR_FAINT;
+			term->c.attr.mode |= ATTR_FAINT;
 			break;
 		case 3:
-			term.c.attr.mode |= ATTR_ITALIC;
+			term->c.attr.mode |= ATTR_ITALIC;
 			break;
 		case 4:
-			term.c.attr.mode |= ATTR_UNDERLINE;
+			term->c.attr.mode |= ATTR_UNDERLINE;
 			break;
 		case 5: /* slow blink */
 			/* FALLTHROUGH */
 		case 6: /* rapid blink */
-			term.c.attr.mode |= ATTR_BLINK;
+			term->c.attr.mode |= ATTR_BLINK;
 			break;
 		case 7:
-			term.c.attr.mode |= ATTR_REVERSE;
+			term->c.attr.mode |= ATTR_REVERSE;
 			break;
 		case 8:
-			term.c.attr.mode |= ATTR_INVISIBLE;
+			term->c.attr.mode |= ATTR_INVISIBLE;
 			break;
 		case 9:
-			term.c.attr.mode |= ATTR_STRUCK;
+			term->c.attr.mode |= ATTR_STRUCK;
 			break;
 		case 22:
-			term.c.attr.mode &= ~(ATTR_BOLD | ATTR_FAINT);
+			term->c.attr.mode &= ~(ATTR_BOLD | ATTR_FAINT);
 			break;
 		case 23:
-			term.c.attr.mode &= ~ATTR_ITALIC;
+			term->c.attr.mode &= ~ATTR_ITALIC;
 			break;
 		case 24:
-			term.c.attr.mode &= ~ATTR_UNDERLINE;
+			term->c.attr.mode &= ~ATTR_UNDERLINE;
 			break;
 		case 25:
-			term.c.attr.mode &= ~ATTR_BLINK;
+			term->c.attr.mode &= ~ATTR_BLINK;
 			break;
 		case 27:
-			term.c.attr.mode &= ~ATTR_REVERSE;
+			term->c.attr.mode &= ~ATTR_REVERSE;
 			break;
 		case 28:
-			term.c.attr.mode &= ~ATTR_INVISIBLE;
+			term->c.attr.mode &= ~ATTR_INVISIBLE;
 			break;
 		case 29:
-			term.c.attr.mode &= ~ATTR_STRUCK;
+			term->c.attr.mode &= ~ATTR_STRUCK;
 			break;
 		case 38:
 			if ((idx = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.fg = idx;
+				term->c.attr.fg = idx;
 			break;
 		case 39:
-			term.c.attr.fg = defaultfg;
+			term->c.attr.fg = defaultfg;
 			break;
 		case 48:
 			if ((idx = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.bg = idx;
+				term->c.attr.bg = idx;
 			break;
 		case 49:
-			term.c.attr.bg = defaultbg;
+			term->c.attr.bg = defaultbg;
 			break;
 		default:
 			if (BETWEEN(attr[i], 30, 37)) {
-				term.c.attr.fg = attr[i] - 30;
+				term->c.attr.fg = attr[i] - 30;
 			} else if (BETWEEN(attr[i], 40, 47)) {
-				term.c.attr.bg = attr[i] - 40;
+				term->c.attr.bg = attr[i] - 40;
 			} else if (BETWEEN(attr[i], 90, 97)) {
-				term.c.attr.fg = attr[i] - 90 + 8;
+				term->c.attr.fg = attr[i] - 90 + 8;
 			} else if (BETWEEN(attr[i], 100, 107)) {
-				term.c.attr.bg = attr[i] - 100 + 8;
+				term->c.attr.bg = attr[i] - 100 + 8;
 			} else {
 				fprintf(stderr,
 					"erresc(default): gfx attr %d unknown\n",
@@ -1973,15 +3270,15 @@ tsetscroll(int t, int b)
 {
 	int temp;
 
-	LIMIT(t, 0, term.row-1);
-	LIMIT(b, 0, term.row-1);
+	LIMIT(t, 0, term->row-1);
+	LIMIT(b, 0, term->row-1);
 	if (t > b) {
 		temp = t;
 		t = b;
 		b = temp;
 	}
-	term.top = t;
-	term.bot = b;
+	term->top = t;
+	term->bot = b;
 }
 
 void
@@ -1994,20 +3291,20 @@ tsetmode(int priv, int set, int *args, int narg)
 		if (priv) {
 			switch (*args) {
 			case 1: /* DECCKM -- Cursor key */
-				MODBIT(term.mode, set, MODE_APPCURSOR);
+				MODBIT(term->mode, set, MODE_APPCURSOR);
 				break;
 			case 5: /* DECSCNM -- Reverse video */
-				mode = term.mode;
-				MODBIT(term.mode, set, MODE_REVERSE);
-				if (mode != term.mode)
+				mode = term->mode;
+				MODBIT(term->mode, set, MODE_REVERSE);
+				if (mode != term->mode)
 					redraw();
 				break;
 			case 6: /* DECOM -- Origin */
-				MODBIT(term.c.state, set, CURSOR_ORIGIN);
+				MODBIT(term->c.state, set, CURSOR_ORIGIN);
 				tmoveato(0, 0);
 				break;
 			case 7: /* DECAWM -- Auto wrap */
-				MODBIT(term.mode, set, MODE_WRAP);
+				MODBIT(term->mode, set, MODE_WRAP);
 				break;
 			case 0:  /* Error (IGNORED) */
 			case 2:  /* DECANM -- ANSI/VT52 (IGNORED) */
@@ -2020,32 +3317,32 @@ tsetmode(int priv, int set, int *args, int narg)
 			case 12: /* att610 -- Start blinking cursor (IGNORED) */
 				break;
 			case 25: /* DECTCEM -- Text Cursor Enable Mode */
-				MODBIT(term.mode, !set, MODE_HIDE);
+				MODBIT(term->mode, !set, MODE_HIDE);
 				break;
 			case 9:    /* X10 mouse compatibility mode */
-				MODBIT(term.mode, 0, MODE_MOUSE);
-				MODBIT(term.mode, set, MODE_MOUSEX10);
+				MODBIT(term->mode, 0, MODE_MOUSE);
+				MODBIT(term->mode, set, MODE_MOUSEX10);
 				break;
 			case 1000: /* 1000: report button press */
-				MODBIT(term.mode, 0, MODE_MOUSE);
-				MODBIT(term.mode, set, MODE_MOUSEBTN);
+				MODBIT(term->mode, 0, MODE_MOUSE);
+				MODBIT(term->mode, set, MODE_MOUSEBTN);
 				break;
 			case 1002: /* 1002: report motion on button press */
-				MODBIT(term.mode, 0, MODE_MOUSE);
-				MODBIT(term.mode, set, MODE_MOUSEMOTION);
+				MODBIT(term->mode, 0, MODE_MOUSE);
+				MODBIT(term->mode, set, MODE_MOUSEMOTION);
 				break;
 			case 1003: /* 1003: enable all mouse motions */
-				MODBIT(term.mode, 0, MODE_MOUSE);
-				MODBIT(term.mode, set, MODE_MOUSEMANY);
+				MODBIT(term->mode, 0, MODE_MOUSE);
+				MODBIT(term->mode, set, MODE_MOUSEMANY);
 				break;
 			case 1004: /* 1004: send focus events to tty */
-				MODBIT(term.mode, set, MODE_FOCUS);
+				MODBIT(term->mode, set, MODE_FOCUS);
 				break;
 			case 1006: /* 1006: extended reporting mode */
-				MODBIT(term.mode, set, MODE_MOUSESGR);
+				MODBIT(term->mode, set, MODE_MOUSESGR);
 				break;
 			case 1034:
-				MODBIT(term.mode, set, MODE_8BIT);
+				MODBIT(term->mode, set, MODE_8BIT);
 				break;
 			case 1049: /* swap screen & set/restore cursor as xterm */
 				if (!allowaltscreen)
@@ -2058,8 +3355,8 @@ tsetmode(int priv, int set, int *args, int narg)
 					break;
 				alt = IS_SET(MODE_ALTSCREEN);
 				if (alt) {
-					tclearregion(0, 0, term.col-1,
-							term.row-1);
+					tclearregion(0, 0, term->col-1,
+							term->row-1);
 				}
 				if (set ^ alt) /* set is always 1 or 0 */
 					tswapscreen();
@@ -2070,7 +3367,18 @@ tsetmode(int priv, int set, int *args, int narg)
 				tcursor((set) ? CURSOR_SAVE : CURSOR_LOAD);
 				break;
 			case 2004: /* 2004: bracketed paste mode */
-				MODBIT(term.mode, set, MODE_BRCKTPASTE);
+				MODBIT(term->mode, set, MODE_BRCKTPASTE);
+				break;
+			case 2026: /* 2026: synchronized update */
+				MODBIT(term->mode, set && synctimeout > 0,
+				       MODE_SYNC);
+				/* sessionswitch() times the others' updates */
+				if (loaded != active)
+					break;
+				if (IS_SET(MODE_SYNC))
+					timerset(&synctimer, synctimeout);
+				else
+					timerstop(&synctimer);
 				break;
 			/* Not implemented mouse modes. See comments there. */
 			case 1001: /* mouse highlight mode; can hang the
@@ -2092,16 +3400,16 @@ tsetmode(int priv, int set, int *args, int narg)
 			case 0:  /* Error (IGNORED) */
 				break;
 			case 2:  /* KAM -- keyboard action */
-				MODBIT(term.mode, set, MODE_KBDLOCK);
+				MODBIT(term->mode, set, MODE_KBDLOCK);
 				break;
 			case 4:  /* IRM -- Insertion-replacement */
-				MODBIT(term.mode, set, MODE_INSERT);
+				MODBIT(term->mode, set, MODE_INSERT);
 				break;
 			case 12: /* SRM -- Send/Receive */
-				MODBIT(term.mode, !set, MODE_ECHO);
+				MODBIT(term->mode, !set, MODE_ECHO);
 				break;
 			case 20: /* LNM -- Linefeed/new line */
-				MODBIT(term.mode, set, MODE_CRLF);
+				MODBIT(term->mode, set, MODE_CRLF);
 				break;
 			default:
 				fprintf(stderr,
@@ -2119,7 +3427,7 @@ csihandle(void)
 	char buf[40];
 	int len;
 
-	switch (csiescseq.mode[0]) {
+	switch (csiescseq->mode[0]) {
 	default:
 	unknown:
 		fprintf(stderr, "erresc: unknown csi ");
@@ -2127,65 +3435,65 @@ csihandle(void)
 		/* die(""); */
 		break;
 	case '@': /* ICH -- Insert <n> blank char */
-		DEFAULT(csiescseq.arg[0], 1);
-		tinsertblank(csiescseq.arg[0]);
+		DEFAULT(csiescseq->arg[0], 1);
+		tinsertblank(csiescseq->arg[0]);
 		break;
 	case 'A': /* CUU -- Cursor <n> Up */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x, term.c.y-csiescseq.arg[0]);
+		DEFAULT(csiescseq->arg[0], 1);
+		tmoveto(term->c.x, term->c.y-csiescseq->arg[0]);
 		break;
 	case 'B': /* CUD -- Cursor <n> Down */
 	case 'e': /* VPR --Cursor <n> Down */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x, term.c.y+csiescseq.arg[0]);
+		DEFAULT(csiescseq->arg[0], 1);
+		tmoveto(term->c.x, term->c.y+csiescseq->arg[0]);
 		break;
 	case 'i': /* MC -- Media Copy */
-		switch (csiescseq.arg[0]) {
+		switch (csiescseq->arg[0]) {
 		case 0:
 			tdump();
 			break;
 		case 1:
-			tdumpline(term.c.y);
+			tdumpline(term->c.y);
 			break;
 		case 2:
 			tdumpsel();
 			break;
 		case 4:
-			term.mode &= ~MODE_PRINT;
+			term->mode &= ~MODE_PRINT;
 			break;
 		case 5:
-			term.mode |= MODE_PRINT;
+			term->mode |= MODE_PRINT;
 			break;
 		}
 		break;
 	case 'c': /* DA -- Device Attributes */
-		if (csiescseq.arg[0] == 0)
+		if (csiescseq->arg[0] == 0)
 			ttywrite(vtiden, sizeof(vtiden) - 1);
 		break;
 	case 'C': /* CUF -- Cursor <n> Forward */
 	case 'a': /* HPR -- Cursor <n> Forward */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x+csiescseq.arg[0], term.c.y);
+		DEFAULT(csiescseq->arg[0], 1);
+		tmoveto(term->c.x+csiescseq->arg[0], term->c.y);
 		break;
 	case 'D': /* CUB -- Cursor <n> Backward */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(term.c.x-csiescseq.arg[0], term.c.y);
+		DEFAULT(csiescseq->arg[0], 1);
+		tmoveto(term->c.x-csiescseq->arg[0], term->c.y);
 		break;
 	case 'E': /* CNL -- Cursor <n> Down and first col */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(0, term.c.y+csiescseq.arg[0]);
+		DEFAULT(csiescseq->arg[0], 1);
+		tmoveto(0, term->c.y+csiescseq->arg[0]);
 		break;
 	case 'F': /* CPL -- Cursor <n> Up and first col */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(0, term.c.y-csiescseq.arg[0]);
+		DEFAULT(csiescseq->arg[0], 1);
+		tmoveto(0, term->c.y-csiescseq->arg[0]);
 		break;
 	case 'g': /* TBC -- Tabulation clear */
-		switch (csiescseq.arg[0]) {
+		switch (csiescseq->arg[0]) {
 		case 0: /* clear current tab stop */
-			term.tabs[term.c.x] = 0;
+			term->tabs[term->c.x] = 0;
 			break;
 		case 3: /* clear all the tabs */
-			memset(term.tabs, 0, term.col * sizeof(*term.tabs));
+			memset(term->tabs, 0, term->col * sizeof(*term->tabs));
 			break;
 		default:
 			goto unknown;
@@ -2193,111 +3501,111 @@ csihandle(void)
 		break;
 	case 'G': /* CHA -- Move to <col> */
 	case '`': /* HPA */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveto(csiescseq.arg[0]-1, term.c.y);
+		DEFAULT(csiescseq->arg[0], 1);
+		tmoveto(csiescseq->arg[0]-1, term->c.y);
 		break;
 	case 'H': /* CUP -- Move to <row> <col> */
 	case 'f': /* HVP */
-		DEFAULT(csiescseq.arg[0], 1);
-		DEFAULT(csiescseq.arg[1], 1);
-		tmoveato(csiescseq.arg[1]-1, csiescseq.arg[0]-1);
+		DEFAULT(csiescseq->arg[0], 1);
+		DEFAULT(csiescseq->arg[1], 1);
+		tmoveato(csiescseq->arg[1]-1, csiescseq->arg[0]-1);
 		break;
 	case 'I': /* CHT -- Cursor Forward Tabulation <n> tab stops */
-		DEFAULT(csiescseq.arg[0], 1);
-		tputtab(csiescseq.arg[0]);
+		DEFAULT(csiescseq->arg[0], 1);
+		tputtab(csiescseq->arg[0]);
 		break;
 	case 'J': /* ED -- Clear screen */
 		selclear();
-		switch (csiescseq.arg[0]) {
+		switch (csiescseq->arg[0]) {
 		case 0: /* below */
-			tclearregion(term.c.x, term.c.y, term.col-1, term.c.y);
-			if (term.c.y < term.row-1) {
-				tclearregion(0, term.c.y+1, term.col-1,
-						term.row-1);
+			tclearregion(term->c.x, term->c.y, term->col-1, term->c.y);
+			if (term->c.y < term->row-1) {
+				tclearregion(0, term->c.y+1, term->col-1,
+						term->row-1);
 			}
 			break;
 		case 1: /* above */
-			if (term.c.y > 1)
-				tclearregion(0, 0, term.col-1, term.c.y-1);
-			tclearregion(0, term.c.y, term.c.x, term.c.y);
+			if (term->c.y > 1)
+				tclearregion(0, 0, term->col-1, term->c.y-1);
+			tclearregion(0, term->c.y, term->c.x, term->c.y);
 			break;
 		case 2: /* all */
-			tclearregion(0, 0, term.col-1, term.row-1);
+			tclearregion(0, 0, term->col-1, term->row-1);
 			break;
 		default:
 			goto unknown;
 		}
 		break;
 	case 'K': /* EL -- Clear line */
-		switch (csiescseq.arg[0]) {
+		switch (csiescseq->arg[0]) {
 		case 0: /* right */
-			tclearregion(term.c.x, term.c.y, term.col-1,
-					term.c.y);
+			tclearregion(term->c.x, term->c.y, term->col-1,
+					term->c.y);
 			break;
 		case 1: /* left */
-			tclearregion(0, term.c.y, term.c.x, term.c.y);
+			tclearregion(0, term->c.y, term->c.x, term->c.y);
 			break;
 		case 2: /* all */
-			tclearregion(0, term.c.y, term.col-1, term.c.y);
+			tclearregion(0, term->c.y, term->col-1, term->c.y);
 			break;
 		}
 		break;
 	case 'S': /* SU -- Scroll <n> line up */
-		DEFAULT(csiescseq.arg[0], 1);
-		tscrollup(term.top, csiescseq.arg[0]);
+		DEFAULT(csiescseq->arg[0], 1);
+		tscrollup(term->top, csiescseq->arg[0]);
 		break;
 	case 'T': /* SD -- Scroll <n> line down */
-		DEFAULT(csiescseq.arg[0], 1);
-		tscrolldown(term.top, csiescseq.arg[0]);
+		DEFAULT(csiescseq->arg[0], 1);
+		tscrolldown(term->top, csiescseq->arg[0]);
 		break;
 	case 'L': /* IL -- Insert <n> blank lines */
-		DEFAULT(csiescseq.arg[0], 1);
-		tinsertblankline(csiescseq.arg[0]);
+		DEFAULT(csiescseq->arg[0], 1);
+		tinsertblankline(csiescseq->arg[0]);
 		break;
 	case 'l': /* RM -- Reset Mode */
-		tsetmode(csiescseq.priv, 0, csiescseq.arg, csiescseq.narg);
+		tsetmode(csiescseq->priv, 0, csiescseq->arg, csiescseq->narg);
 		break;
 	case 'M': /* DL -- Delete <n> lines */
-		DEFAULT(csiescseq.arg[0], 1);
-		tdeleteline(csiescseq.arg[0]);
+		DEFAULT(csiescseq->arg[0], 1);
+		tdeleteline(csiescseq->arg[0]);
 		break;
 	case 'X': /* ECH -- Erase <n> char */
-		DEFAULT(csiescseq.arg[0], 1);
-		tclearregion(term.c.x, term.c.y,
-				term.c.x + csiescseq.arg[0] - 1, term.c.y);
+		DEFAULT(csiescseq->arg[0], 1);
+		tclearregion(term->c.x, term->c.y,
+				term->c.x + csiescseq->arg[0] - 1, term->c.y);
 		break;
 	case 'P': /* DCH -- Delete <n> char */
-		DEFAULT(csiescseq.arg[0], 1);
-		tdeletechar(csiescseq.arg[0]);
+		DEFAULT(csiescseq->arg[0], 1);
+		tdeletechar(csiescseq->arg[0]);
 		break;
 	case 'Z': /* CBT -- Cursor Backward Tabulation <n> tab stops */
-		DEFAULT(csiescseq.arg[0], 1);
-		tputtab(-csiescseq.arg[0]);
+		DEFAULT(csiescseq->arg[0], 1);
+		tputtab(-csiescseq->arg[0]);
 		break;
 	case 'd': /* VPA -- Move to <row> */
-		DEFAULT(csiescseq.arg[0], 1);
-		tmoveato(term.c.x, csiescseq.arg[0]-1);
+		DEFAULT(csiescseq->arg[0], 1);
+		tmoveato(term->c.x, csiescseq->arg[0]-1);
 		break;
 	case 'h': /* SM -- Set terminal mode */
-		tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
+		tsetmode(csiescseq->priv, 1, csiescseq->arg, csiescseq->narg);
 		break;
 	case 'm': /* SGR -- Terminal attribute (color) */
-		tsetattr(csiescseq.arg, csiescseq.narg);
+		tsetattr(csiescseq->arg, csiescseq->narg);
 		break;
 	case 'n': /* DSR – Device Status Report (cursor position) */
-		if (csiescseq.arg[0] == 6) {
+		if (csiescseq->arg[0] == 6) {
 			len = snprintf(buf, sizeof(buf),"\033[%i;%iR",
-					term.c.y+1, term.c.x+1);
+					term->c.y+1, term->c.x+1);
 			ttywrite(buf, len);
 		}
 		break;
 	case 'r': /* DECSTBM -- Set Scrolling Region */
-		if (csiescseq.priv) {
+		if (csiescseq->priv) {
 			goto unknown;
 		} else {
-			DEFAULT(csiescseq.arg[0], 1);
-			DEFAULT(csiescseq.arg[1], term.row);
-			tsetscroll(csiescseq.arg[0]-1, csiescseq.arg[1]-1);
+			DEFAULT(csiescseq->arg[0], 1);
+			DEFAULT(csiescseq->arg[1], term->row);
+			tsetscroll(csiescseq->arg[0]-1, csiescseq->arg[1]-1);
 			tmoveato(0, 0);
 		}
 		break;
@@ -2308,13 +3616,14 @@ csihandle(void)
 		tcursor(CURSOR_LOAD);
 		break;
 	case ' ':
-		switch (csiescseq.mode[1]) {
+		switch (csiescseq->mode[1]) {
 		case 'q': /* DECSCUSR -- Set Cursor Style */
-			DEFAULT(csiescseq.arg[0], 1);
-			if (!BETWEEN(csiescseq.arg[0], 0, 6)) {
+			DEFAULT(csiescseq->arg[0], 1);
+			if (!BETWEEN(csiescseq->arg[0], 0, 6)) {
 				goto unknown;
 			}
-			wl.cursor = csiescseq.arg[0];
+			term->cursor = csiescseq->arg[0];
+			cursorblinkreset();
 			break;
 		default:
 			goto unknown;
@@ -2330,8 +3639,8 @@ csidump(void)
 	uint c;
 
 	fprintf(stderr, "ESC[");
-	for (i = 0; i < csiescseq.len; i++) {
-		c = csiescseq.buf[i] & 0xff;
+	for (i = 0; i < csiescseq->len; i++) {
+		c = csiescseq->buf[i] & 0xff;
 		if (isprint(c)) {
 			putc(c, stderr);
 		} else if (c == '\n') {
@@ -2350,7 +3659,7 @@ csidump(void)
 void
 csireset(void)
 {
-	memset(&csiescseq, 0, sizeof(csiescseq));
+	memset(csiescseq, 0, sizeof(*csiescseq));
 }
 
 void
@@ -2359,26 +3668,31 @@ strhandle(void)
 	char *p = NULL;
 	int j, narg, par;
 
-	term.esc &= ~(ESC_STR_END|ESC_STR);
+	term->esc &= ~ESC_STR_END;
+	if (strescseq->overflow) {
+		fprintf(stderr, "erresc: %c string longer than %u bytes\n",
+			strescseq->type, strbufmax);
+		return;
+	}
 	strparse();
-	par = (narg = strescseq.narg) ? atoi(strescseq.args[0]) : 0;
+	par = (narg = strescseq->narg) ? atoi(strescseq->args[0]) : 0;
 
-	switch (strescseq.type) {
+	switch (strescseq->type) {
 	case ']': /* OSC -- Operating System Command */
 		switch (par) {
 		case 0:
 		case 1:
 		case 2:
 			if (narg > 1)
-				wlsettitle(strescseq.args[1]);
+				wlsettitle(strescseq->args[1]);
 			return;
 		case 4: /* color set */
 			if (narg < 3)
 				break;
-			p = strescseq.args[2];
+			p = strescseq->args[2];
 			/* FALLTHROUGH */
 		case 104: /* color reset, here p = NULL */
-			j = (narg > 1) ? atoi(strescseq.args[1]) : -1;
+			j = (narg > 1) ? atoi(strescseq->args[1]) : -1;
 			if (wlsetcolorname(j, p)) {
 				fprintf(stderr, "erresc: invalid color %s\n", p);
 			} else {
@@ -2389,13 +3703,24 @@ strhandle(void)
 				redraw();
 			}
 			return;
+		case 52: /* clipboard set, Pc is ignored and queries unanswered */
+			if (!osc52->active || osc52->query)
+				return;
+			if (osc52flush()) {
+				wlsetsel(osc52->buf, wl.serial);
+				osc52->buf = NULL;
+				osc52->siz = 0;
+			} else if (osc52->overflow) {
+				fprintf(stderr, "erresc: OSC 52 payload longer "
+					"than %u bytes\n", osc52max);
+			}
+			return;
 		}
 		break;
 	case 'k': /* old title set compatibility */
-		wlsettitle(strescseq.args[0]);
+		wlsettitle(strescseq->args[0]);
 		return;
 	case 'P': /* DCS -- Device Control String */
-		term.mode |= ESC_DCS;
 	case '_': /* APC -- Application Program Command */
 	case '^': /* PM -- Privacy Message */
 		return;
@@ -2408,22 +3733,19 @@ strhandle(void)
 void
 strparse(void)
 {
-	int c;
-	char *p = strescseq.buf;
-
-	strescseq.narg = 0;
-	strescseq.buf[strescseq.len] = '\0';
+	int i;
 
-	if (*p == '\0')
+	/* the separators were recorded by strput as the string arrived */
+	strescseq->narg = 0;
+	if (strescseq->len == 0)
 		return;
+	strescseq->buf[strescseq->len] = '\0';
 
-	while (strescseq.narg < STR_ARG_SIZ) {
-		strescseq.args[strescseq.narg++] = p;
-		while ((c = *p) != ';' && c != '\0')
-			++p;
-		if (c == '\0')
-			return;
-		*p++ = '\0';
+	strescseq->args[strescseq->narg++] = strescseq->buf;
+	for (i = 0; i < strescseq->nsep; i++) {
+		strescseq->buf[strescseq->sep[i]] = '\0';
+		strescseq->args[strescseq->narg++] =
+			&strescseq->buf[strescseq->sep[i] + 1];
 	}
 }
 
@@ -2433,9 +3755,9 @@ strdump(void)
 	int i;
 	uint c;
 
-	fprintf(stderr, "ESC%c", strescseq.type);
-	for (i = 0; i < strescseq.len; i++) {
-		c = strescseq.buf[i] & 0xff;
+	fprintf(stderr, "ESC%c", strescseq->type);
+	for (i = 0; i < strescseq->len; i++) {
+		c = strescseq->buf[i] & 0xff;
 		if (c == '\0') {
 			putc('\n', stderr);
 			return;
@@ -2457,181 +3779,674 @@ strdump(void)
 void
 strreset(void)
 {
-	memset(&strescseq, 0, sizeof(strescseq));
-}
-
-void
-sendbreak(const Arg *arg)
-{
-	if (tcsendbreak(cmdfd, 0))
-		perror("Error sending break");
-}
+	char *buf = strescseq->buf;
+	size_t siz = strescseq->siz;
 
-void
-tprinter(char *s, size_t len)
-{
-	if (iofd != -1 && xwrite(iofd, s, len) < 0) {
-		fprintf(stderr, "Error writing in %s:%s\n",
-			opt_io, strerror(errno));
-		close(iofd);
-		iofd = -1;
+	/* keep a small buffer around, give back the memory of big ones */
+	if (siz > STR_BUF_SIZ) {
+		free(buf);
+		buf = NULL;
+		siz = 0;
 	}
+	memset(strescseq, 0, sizeof(*strescseq));
+	strescseq->buf = buf;
+	strescseq->siz = siz;
+
+	free(osc52->buf);
+	memset(osc52, 0, sizeof(*osc52));
 }
 
 void
-iso14755(const Arg *arg)
+strput(const char *s, size_t n)
 {
-	FILE *p;
-	char *us, *e, codepoint[9], uc[UTF_SIZ];
-	unsigned long utf32;
+	const char *p, *end = s + n;
+	size_t siz;
 
-	if (!(p = popen(ISO14755CMD, "r")))
+	if (osc52->active) {
+		osc52put(s, n);
 		return;
+	}
+	if (strescseq->overflow)
+		return;
+	if (strescseq->len + n >= strescseq->siz) {
+		if (strescseq->len + n >= strbufmax) {
+			strescseq->overflow = 1;
+			return;
+		}
+		siz = MAX(strescseq->siz, STR_BUF_SIZ);
+		while (siz <= strescseq->len + n)
+			siz *= 2;
+		strescseq->siz = MIN(siz, strbufmax);
+		strescseq->buf = xrealloc(strescseq->buf, strescseq->siz);
+	}
 
-	us = fgets(codepoint, sizeof(codepoint), p);
-	pclose(p);
+	/* the last of the STR_ARG_SIZ arguments keeps the rest, ';' and all */
+	for (p = s; strescseq->nsep < STR_ARG_SIZ - 1 &&
+	     (p = memchr(p, ';', end - p)); p++)
+		strescseq->sep[strescseq->nsep++] = strescseq->len + (p - s);
 
-	if (!us || *us == '\0' || *us == '-' || strlen(us) > 7)
-		return;
-	if ((utf32 = strtoul(us, &e, 16)) == ULONG_MAX ||
-	    (*e != '\n' && *e != '\0'))
-		return;
+	memcpy(&strescseq->buf[strescseq->len], s, n);
+	strescseq->len += n;
 
-	ttysend(uc, utf8encode(utf32, uc));
+	/* from here on an OSC 52 payload bypasses buf */
+	if (strescseq->type == ']' && strescseq->nsep >= 2 &&
+	    strescseq->sep[0] == 2 && !strncmp(strescseq->buf, "52", 2) &&
+	    osc52max > 0)
+		osc52start();
 }
 
 void
-toggleprinter(const Arg *arg)
+osc52start(void)
 {
-	term.mode ^= MODE_PRINT;
-}
+	size_t data = strescseq->sep[1] + 1, n = strescseq->len - data;
 
-void
-printscreen(const Arg *arg)
-{
-	tdump();
+	osc52->active = 1;
+	strescseq->len = data;
+	osc52put(&strescseq->buf[data], n);
 }
 
+/*
+ * Decode base64 into osc52->buf. Characters outside the alphabet are
+ * skipped, as xterm does, and '=' ends the payload.
+ */
 void
-printsel(const Arg *arg)
+osc52put(const char *s, size_t n)
 {
-	tdumpsel();
-}
+	static uchar val[256];
+	static const char alpha[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const uchar *p = (const uchar *)s, *end = p + n;
+	uint a, b, c, d;
+	int i;
 
-void
-tdumpsel(void)
-{
-	char *ptr;
+	if (!val[0]) {
+		memset(val, 0x80, sizeof(val));
+		for (i = 0; i < 64; i++)
+			val[(uchar)alpha[i]] = i;
+	}
+	if (osc52->overflow || osc52->end)
+		return;
 
-	if ((ptr = getsel())) {
-		tprinter(ptr, strlen(ptr));
-		free(ptr);
+	while (p < end) {
+		/* whole quanta: four lookups, one validity test, three bytes */
+		while (osc52->nacc == 0 && end - p >= 4) {
+			a = val[p[0]], b = val[p[1]], c = val[p[2]], d = val[p[3]];
+			if ((a | b | c | d) & 0x80)
+				break;
+			osc52emit(a << 18 | b << 12 | c << 6 | d, 3);
+			if (osc52->overflow)
+				return;
+			p += 4;
+		}
+		if (p == end)
+			break;
+
+		/* a quantum split across calls or around a skipped character */
+		if (*p == '?' && !osc52->len && !osc52->nacc) {
+			osc52->query = osc52->end = 1;
+			return;
+		}
+		if (*p == '=') {
+			osc52flush();
+			osc52->end = 1;
+			return;
+		}
+		if (!((a = val[*p++]) & 0x80)) {
+			osc52->acc = osc52->acc << 6 | a;
+			if (++osc52->nacc == 4) {
+				osc52emit(osc52->acc, 3);
+				osc52->acc = osc52->nacc = 0;
+				if (osc52->overflow)
+					return;
+			}
+		}
 	}
 }
 
 void
-tdumpline(int n)
+osc52emit(uint v, int n)
 {
-	char buf[UTF_SIZ];
-	Glyph *bp, *end;
+	size_t siz;
 
-	bp = &term.line[n][0];
-	end = &bp[MIN(tlinelen(n), term.col) - 1];
-	if (bp != end || bp->u != ' ') {
-		for ( ;bp <= end; ++bp)
-			tprinter(buf, utf8encode(bp->u, buf));
+	if (osc52->len + n > osc52max) {
+		osc52->overflow = 1;
+		return;
 	}
-	tprinter("\n", 1);
+	/* one spare byte for the terminating NUL */
+	if (osc52->len + n >= osc52->siz) {
+		siz = MAX(osc52->siz * 2, STR_BUF_SIZ);
+		osc52->siz = MIN(siz, (size_t)osc52max + 1);
+		osc52->buf = xrealloc(osc52->buf, osc52->siz);
+	}
+	osc52->buf[osc52->len++] = v >> 16;
+	if (n > 1)
+		osc52->buf[osc52->len++] = v >> 8;
+	if (n > 2)
+		osc52->buf[osc52->len++] = v;
 }
 
-void
-tdump(void)
+/* Emit an unpadded final quantum and terminate; false on overflow */
+int
+osc52flush(void)
 {
-	int i;
-
-	for (i = 0; i < term.row; ++i)
-		tdumpline(i);
+	if (osc52->nacc >= 2 && !osc52->overflow && !osc52->end)
+		osc52emit(osc52->acc << 6 * (4 - osc52->nacc), osc52->nacc - 1);
+	osc52->nacc = 0;
+	if (osc52->overflow)
+		return 0;
+	if (!osc52->buf)
+		osc52->buf = xmalloc(1);
+	osc52->buf[osc52->len] = '\0';
+	return 1;
 }
 
+/*
+ * Called on the 'q' of a DCS. Its parameters (pixel aspect ratio and
+ * background select) are ignored: pixels that are never drawn get the
+ * default background colour.
+ */
 void
-tputtab(int n)
-{
-	uint x = term.c.x;
+sixelstart(void)
+{
+	/* VT340 default colour registers, in percent */
+	static const uchar vt340[16][3] = {
+		{  0,  0,  0 }, { 20, 20, 80 }, { 80, 13, 13 }, { 20, 80, 20 },
+		{ 80, 20, 80 }, { 20, 80, 80 }, { 80, 80, 20 }, { 53, 53, 53 },
+		{ 26, 26, 26 }, { 33, 33, 60 }, { 60, 26, 26 }, { 33, 60, 33 },
+		{ 60, 33, 60 }, { 33, 60, 60 }, { 60, 60, 33 }, { 80, 80, 80 },
+	};
+	int i;
 
-	if (n > 0) {
-		while (x < term.col && n--)
-			for (++x; x < term.col && !term.tabs[x]; ++x)
-				/* nothing */ ;
-	} else if (n < 0) {
-		while (x > 0 && n++)
-			for (--x; x > 0 && !term.tabs[x]; --x)
-				/* nothing */ ;
+	free(sixel->px);
+	memset(sixel, 0, sizeof(*sixel));
+	for (i = 0; i < LEN(vt340); i++) {
+		sixel->pal[i] = (vt340[i][0] * 255 / 100) << 16 |
+		               (vt340[i][1] * 255 / 100) << 8 |
+		               (vt340[i][2] * 255 / 100);
 	}
-	term.c.x = LIMIT(x, 0, term.col-1);
+	sixel->col = sixel->pal[0];
+	sixel->bg = dc.col[defaultbg] & 0xFFFFFF;
+	sixel->rep = 1;
+	term->mode |= MODE_SIXEL;
 }
 
+/* make room for pixels up to (w, h), clipped to IMG_MAX */
 void
-techo(Rune u)
-{
-	if (ISCONTROL(u)) { /* control code */
-		if (u & 0x80) {
-			u &= 0x7f;
-			tputc('^');
-			tputc('[');
-		} else if (u != '\n' && u != '\r' && u != '\t') {
-			u ^= 0x40;
-			tputc('^');
+sixelgrow(int w, int h)
+{
+	int cw = MAX(sixel->cw, 64), ch = MAX(sixel->ch, 60), y, x;
+	uint32_t *px;
+
+	while (cw < w)
+		cw *= 2;
+	while (ch < h)
+		ch *= 2;
+	cw = MIN(cw, IMG_MAX);
+	ch = MIN(ch, IMG_MAX);
+	if (cw == sixel->cw && ch == sixel->ch)
+		return;
+
+	px = xmalloc(cw * ch * sizeof(*px));
+	for (y = 0; y < ch; y++) {
+		x = 0;
+		if (y < sixel->ch) {
+			memcpy(&px[y * cw], &sixel->px[y * sixel->cw],
+			       sixel->cw * sizeof(*px));
+			x = sixel->cw;
 		}
+		for (; x < cw; x++)
+			px[y * cw + x] = sixel->bg;
 	}
-	tputc(u);
-	needdraw = true;
+	free(sixel->px);
+	sixel->px = px;
+	sixel->cw = cw;
+	sixel->ch = ch;
 }
 
-void
-tdefutf8(char ascii)
+int
+sixelhue(int m1, int m2, int h)
 {
-	if (ascii == 'G')
-		term.mode |= MODE_UTF8;
-	else if (ascii == '@')
-		term.mode &= ~MODE_UTF8;
+	h = (h + 360) % 360;
+	if (h < 60)
+		return m1 + (m2 - m1) * h / 60;
+	if (h < 180)
+		return m2;
+	if (h < 240)
+		return m1 + (m2 - m1) * (240 - h) / 60;
+	return m1;
 }
 
-void
-tdeftran(char ascii)
+/* HLS in degrees and percent to RGB, hue 0 being blue as on the VT340 */
+uint32_t
+sixelhls(int h, int l, int s)
 {
-	static char cs[] = "0B";
-	static int vcs[] = {CS_GRAPHIC0, CS_USA};
-	char *p;
+	int m1, m2;
 
-	if ((p = strchr(cs, ascii)) == NULL) {
-		fprintf(stderr, "esc unhandled charset: ESC ( %c\n", ascii);
-	} else {
-		term.trantbl[term.icharset] = vcs[p - cs];
-	}
+	h += 240;
+	m2 = (l <= 50) ? l * (100 + s) / 100 : l + s - l * s / 100;
+	m1 = 2 * l - m2;
+	return (sixelhue(m1, m2, h + 120) * 255 / 100) << 16 |
+	       (sixelhue(m1, m2, h) * 255 / 100) << 8 |
+	       (sixelhue(m1, m2, h - 120) * 255 / 100);
 }
 
+/* run the command whose parameters were just read */
 void
-tdectest(char c)
+sixelcmd(void)
 {
-	int x, y;
+	int *p = sixel->p, i;
 
-	if (c == '8') { /* DEC screen alignment test. */
-		for (x = 0; x < term.col; ++x) {
-			for (y = 0; y < term.row; ++y)
-				tsetchar('E', &term.c.attr, x, y);
+	switch (sixel->state) {
+	case SX_REPEAT:
+		sixel->rep = MAX(p[0], 1);
+		break;
+	case SX_COLOR:
+		i = p[0] & 0xFF;
+		if (sixel->np >= 5 && p[1] == 2) {
+			sixel->pal[i] = (MIN(p[2], 100) * 255 / 100) << 16 |
+			               (MIN(p[3], 100) * 255 / 100) << 8 |
+			               (MIN(p[4], 100) * 255 / 100);
+		} else if (sixel->np >= 5 && p[1] == 1) {
+			sixel->pal[i] = sixelhls(p[2] % 360, MIN(p[3], 100),
+			                        MIN(p[4], 100));
 		}
+		sixel->col = sixel->pal[i];
+		break;
+	case SX_RASTER:
+		if (sixel->np >= 4) {
+			sixel->rw = MIN(p[2], IMG_MAX);
+			sixel->rh = MIN(p[3], IMG_MAX);
+		}
+		break;
 	}
+	sixel->state = SX_DATA;
 }
 
+/* decode sixel data, parameters and commands can span calls */
 void
-tstrsequence(uchar c)
-{
-	strreset();
-
-	switch (c) {
+sixelwrite(const uchar *s, size_t n)
+{
+	const uchar *end = s + n;
+	uint32_t *row, col;
+	int c, b, i, rep, x;
+
+	for (; s < end; s++) {
+		c = *s;
+		if (sixel->state != SX_DATA) {
+			if (BETWEEN(c, '0', '9')) {
+				if (sixel->np == 0)
+					sixel->np = 1;
+				i = sixel->np - 1;
+				sixel->p[i] = MIN(sixel->p[i] * 10 + c - '0', 99999);
+				continue;
+			}
+			if (c == ';') {
+				if (sixel->np == 0)
+					sixel->np = 1;
+				if (sixel->np < LEN(sixel->p))
+					sixel->p[sixel->np++] = 0;
+				continue;
+			}
+			sixelcmd();
+		}
+
+		switch (c) {
+		case '!':
+		case '#':
+		case '"':
+			sixel->state = c == '!' ? SX_REPEAT :
+			              c == '#' ? SX_COLOR : SX_RASTER;
+			sixel->np = 0;
+			memset(sixel->p, 0, sizeof(sixel->p));
+			continue;
+		case '$': /* graphics carriage return */
+			sixel->x = 0;
+			continue;
+		case '-': /* graphics new line */
+			sixel->x = 0;
+			sixel->y += 6;
+			continue;
+		}
+		if (!BETWEEN(c, '?', '~'))
+			continue;
+
+		c -= '?';
+		rep = sixel->rep;
+		sixel->rep = 1;
+		x = sixel->x;
+		sixel->x += rep;
+		if (x >= IMG_MAX || sixel->y >= IMG_MAX)
+			continue;
+		rep = MIN(rep, IMG_MAX - x);
+		if (x + rep > sixel->cw || sixel->y + 6 > sixel->ch)
+			sixelgrow(MAX(x + rep, sixel->rw), MAX(sixel->y + 6, sixel->rh));
+		sixel->w = MAX(sixel->w, x + rep);
+		if (!c)
+			continue;
+
+		col = sixel->col;
+		for (b = 0; b < 6 && sixel->y + b < sixel->ch; b++) {
+			if (!(c & 1 << b))
+				continue;
+			sixel->h = MAX(sixel->h, sixel->y + b + 1);
+			row = &sixel->px[(sixel->y + b) * sixel->cw + x];
+			for (i = 0; i < rep; i++)
+				row[i] = col;
+		}
+	}
+}
+
+/* finish the image and put it on the grid, unless it was cancelled */
+void
+sixelend(int cancel)
+{
+	Image *im;
+	int id, y, w, h;
+
+	term->mode &= ~MODE_SIXEL;
+	if (sixel->state != SX_DATA)
+		sixelcmd();
+	w = MAX(sixel->w, sixel->rw);
+	h = MAX(sixel->h, sixel->rh);
+	if (cancel || !w || !h) {
+		free(sixel->px);
+		sixel->px = NULL;
+		return;
+	}
+	sixelgrow(w, h);
+	w = MIN(w, sixel->cw);
+	h = MIN(h, sixel->ch);
+
+	for (id = 0; id < nimages && (images[id].px || images[id].refs); id++)
+		;
+	if (id == nimages)
+		images = xrealloc(images, ++nimages * sizeof(*images));
+	im = &images[id];
+	*im = (Image){ .w = w, .h = h };
+	if (w == sixel->cw) {
+		im->px = sixel->px;
+	} else {
+		im->px = xmalloc(w * h * sizeof(*im->px));
+		for (y = 0; y < h; y++) {
+			memcpy(&im->px[y * w], &sixel->px[y * sixel->cw],
+			       w * sizeof(*im->px));
+		}
+		free(sixel->px);
+	}
+	sixel->px = NULL;
+	timage(id);
+}
+
+/* cover the cells under image id from the cursor on, scrolling as needed */
+void
+timage(int id)
+{
+	Image *im = &images[id];
+	Glyph g = { ' ', ATTR_IMAGE, id, 0 };
+	int cols = (im->w + wl.cw - 1) / wl.cw, rows = (im->h + wl.ch - 1) / wl.ch;
+	int x0 = term->c.x, x, y;
+
+	/* held while placed, a tall image scrolls its first cells away */
+	imgref(&g, 1);
+	for (y = 0; y < rows; y++) {
+		for (x = 0; x < cols && x0 + x < term->col; x++) {
+			g.bg = x << 16 | y;
+			tsetchar(' ', &g, x0 + x, term->c.y);
+		}
+		/* leave the cursor on the line below the image */
+		if (term->c.y == term->bot)
+			tscrollup(term->top, 1);
+		else
+			tmoveto(x0, term->c.y + 1);
+	}
+	imgunref(&g, 1);
+}
+
+/* count n cells at g as showing their images */
+void
+imgref(Glyph *g, int n)
+{
+	for (; n > 0; g++, n--) {
+		if (g->mode & ATTR_IMAGE && g->fg < nimages)
+			images[g->fg].refs++;
+	}
+}
+
+/* the n cells at g are overwritten: free the images they showed last */
+void
+imgunref(Glyph *g, int n)
+{
+	Image *im;
+
+	for (; n > 0; g++, n--) {
+		if (!(g->mode & ATTR_IMAGE) || g->fg >= nimages)
+			continue;
+		im = &images[g->fg];
+		if (--im->refs > 0)
+			continue;
+		free(im->px);
+		im->px = NULL;
+		if (im->buf)
+			wld_buffer_unreference(im->buf);
+		im->buf = NULL;
+	}
+}
+
+void
+sendbreak(const Arg *arg)
+{
+	if (tcsendbreak(loaded->cmdfd, 0))
+		perror("Error sending break");
+}
+
+/*
+ * Printed output is gathered and written when the buffer fills up or
+ * printflushtimeout after it started filling, not a syscall per rune.
+ * The buffer holds one session's output at a time.
+ */
+void
+tprinter(char *s, size_t len)
+{
+	if (iofd == -1)
+		return;
+	if (printlen > 0 && printer != loaded)
+		printflush();
+	printer = loaded;
+	if (printlen + len > sizeof(printbuf)) {
+		printflush();
+		if (len > sizeof(printbuf)) {
+			printwrite(s, len);
+			return;
+		}
+	}
+	memcpy(printbuf + printlen, s, len);
+	printlen += len;
+	if (!printtimer.idx)
+		timerset(&printtimer, printflushtimeout);
+}
+
+void
+printwrite(char *s, size_t len)
+{
+	if (iofd != -1 && xwrite(iofd, s, len) < 0) {
+		fprintf(stderr, "Error writing in %s:%s\n",
+			opt_io, strerror(errno));
+		close(iofd);
+		iofd = -1;
+	}
+}
+
+void
+printflush(void)
+{
+	timerstop(&printtimer);
+	if (printlen > 0)
+		printwrite(printbuf, printlen);
+	printlen = 0;
+}
+
+void
+printtick(Timer *t)
+{
+	printflush();
+}
+
+void
+iso14755(const Arg *arg)
+{
+	FILE *p;
+	char *us, *e, codepoint[9], uc[UTF_SIZ];
+	unsigned long utf32;
+
+	if (!(p = popen(ISO14755CMD, "r")))
+		return;
+
+	us = fgets(codepoint, sizeof(codepoint), p);
+	pclose(p);
+
+	if (!us || *us == '\0' || *us == '-' || strlen(us) > 7)
+		return;
+	if ((utf32 = strtoul(us, &e, 16)) == ULONG_MAX ||
+	    (*e != '\n' && *e != '\0'))
+		return;
+
+	ttysend(uc, utf8encode(utf32, uc));
+}
+
+void
+toggleprinter(const Arg *arg)
+{
+	term->mode ^= MODE_PRINT;
+}
+
+void
+printscreen(const Arg *arg)
+{
+	tdump();
+}
+
+void
+printsel(const Arg *arg)
+{
+	tdumpsel();
+}
+
+void
+tdumpsel(void)
+{
+	char *ptr;
+
+	if ((ptr = getsel())) {
+		tprinter(ptr, strlen(ptr));
+		free(ptr);
+	}
+}
+
+void
+tdumpline(int n)
+{
+	char buf[UTF_SIZ];
+	Glyph *bp, *end;
+
+	bp = &term->line[n][0];
+	end = &bp[MIN(tlinelen(n), term->col) - 1];
+	if (bp != end || bp->u != ' ') {
+		for ( ;bp <= end; ++bp)
+			tprinter(buf, utf8encode(bp->u, buf));
+	}
+	tprinter("\n", 1);
+}
+
+void
+tdump(void)
+{
+	int i;
+
+	for (i = 0; i < term->row; ++i)
+		tdumpline(i);
+}
+
+void
+tputtab(int n)
+{
+	uint x = term->c.x;
+
+	if (n > 0) {
+		while (x < term->col && n--)
+			for (++x; x < term->col && !term->tabs[x]; ++x)
+				/* nothing */ ;
+	} else if (n < 0) {
+		while (x > 0 && n++)
+			for (--x; x > 0 && !term->tabs[x]; --x)
+				/* nothing */ ;
+	}
+	term->c.x = LIMIT(x, 0, term->col-1);
+}
+
+void
+techo(Rune u)
+{
+	if (ISCONTROL(u)) { /* control code */
+		if (u & 0x80) {
+			u &= 0x7f;
+			tputc('^');
+			tputc('[');
+		} else if (u != '\n' && u != '\r' && u != '\t') {
+			u ^= 0x40;
+			tputc('^');
+		}
+	}
+	tputc(u);
+	win->needdraw = true;
+}
+
+void
+tdefutf8(char ascii)
+{
+	if (ascii == 'G')
+		term->mode |= MODE_UTF8;
+	else if (ascii == '@')
+		term->mode &= ~MODE_UTF8;
+}
+
+void
+tdeftran(char ascii)
+{
+	static char cs[] = "0B";
+	static int vcs[] = {CS_GRAPHIC0, CS_USA};
+	char *p;
+
+	if ((p = strchr(cs, ascii)) == NULL) {
+		fprintf(stderr, "esc unhandled charset: ESC ( %c\n", ascii);
+	} else {
+		term->trantbl[term->icharset] = vcs[p - cs];
+	}
+}
+
+void
+tdectest(char c)
+{
+	int x, y;
+
+	if (c == '8') { /* DEC screen alignment test. */
+		for (x = 0; x < term->col; ++x) {
+			for (y = 0; y < term->row; ++y)
+				tsetchar('E', &term->c.attr, x, y);
+		}
+	}
+}
+
+void
+tstrsequence(uchar c)
+{
+	strreset();
+
+	switch (c) {
 	case 0x90:   /* DCS -- Device Control String */
 		c = 'P';
-		term.esc |= ESC_DCS;
+		/* FALLTHROUGH */
+	case 'P':
+		term->esc |= ESC_DCS;
 		break;
 	case 0x9f:   /* APC -- Application Program Command */
 		c = '_';
@@ -2643,8 +4458,8 @@ tstrsequence(uchar c)
 		c = ']';
 		break;
 	}
-	strescseq.type = c;
-	term.esc |= ESC_STR;
+	strescseq->type = c;
+	term->esc = (term->esc & ~ESC_STATE) | ESC_STR;
 }
 
 void
@@ -2655,10 +4470,10 @@ tcontrolcode(uchar ascii)
 		tputtab(1);
 		return;
 	case '\b':   /* BS */
-		tmoveto(term.c.x-1, term.c.y);
+		tmoveto(term->c.x-1, term->c.y);
 		return;
 	case '\r':   /* CR */
-		tmoveto(0, term.c.y);
+		tmoveto(0, term->c.y);
 		return;
 	case '\f':   /* LF */
 	case '\v':   /* VT */
@@ -2667,11 +4482,11 @@ tcontrolcode(uchar ascii)
 		tnewline(IS_SET(MODE_CRLF));
 		return;
 	case '\a':   /* BEL */
-		if (term.esc & ESC_STR_END) {
+		if (term->esc & ESC_STR_END) {
 			/* backwards compatibility to xterm */
 			strhandle();
 		} else {
-			if (!(wl.state & WIN_FOCUSED))
+			if (!(win->state & WIN_FOCUSED))
 				wlseturgency(1);
 			/* XXX: No bell on wayland
 			 * if (bellvolume)
@@ -2679,17 +4494,12 @@ tcontrolcode(uchar ascii)
 			 */
 		}
 		break;
-	case '\033': /* ESC */
-		csireset();
-		term.esc &= ~(ESC_CSI|ESC_ALTCHARSET|ESC_TEST);
-		term.esc |= ESC_START;
-		return;
 	case '\016': /* SO (LS1 -- Locking shift 1) */
 	case '\017': /* SI (LS0 -- Locking shift 0) */
-		term.charset = 1 - (ascii - '\016');
+		term->charset = 1 - (ascii - '\016');
 		return;
 	case '\032': /* SUB */
-		tsetchar('?', &term.c.attr, term.c.x, term.c.y);
+		tsetchar('?', &term->c.attr, term->c.x, term->c.y);
 	case '\030': /* CAN */
 		csireset();
 		break;
@@ -2712,7 +4522,7 @@ tcontrolcode(uchar ascii)
 	case 0x87:   /* TODO: ESA */
 		break;
 	case 0x88:   /* HTS -- Horizontal tab stop */
-		term.tabs[term.c.x] = 1;
+		term->tabs[term->c.x] = 1;
 		break;
 	case 0x89:   /* TODO: HTJ */
 	case 0x8a:   /* TODO: VTS */
@@ -2737,70 +4547,41 @@ tcontrolcode(uchar ascii)
 	case 0x9b:   /* TODO: CSI */
 	case 0x9c:   /* TODO: ST */
 		break;
-	case 0x90:   /* DCS -- Device Control String */
-	case 0x9d:   /* OSC -- Operating System Command */
-	case 0x9e:   /* PM -- Privacy Message */
-	case 0x9f:   /* APC -- Application Program Command */
-		tstrsequence(ascii);
-		return;
 	}
 	/* only CAN, SUB, \a and C1 chars interrupt a sequence */
-	term.esc &= ~(ESC_STR_END|ESC_STR);
+	term->esc &= ~ESC_STR_END;
 }
 
 /*
- * returns 1 when the sequence is finished and it hasn't to read
- * more characters for this sequence, otherwise 0
+ * final character of an ESC sequence; introducers of longer sequences
+ * are routed by esctable and never get here
  */
-int
+void
 eschandle(uchar ascii)
 {
 	switch (ascii) {
-	case '[':
-		term.esc |= ESC_CSI;
-		return 0;
-	case '#':
-		term.esc |= ESC_TEST;
-		return 0;
-	case '%':
-		term.esc |= ESC_UTF8;
-		return 0;
-	case 'P': /* DCS -- Device Control String */
-	case '_': /* APC -- Application Program Command */
-	case '^': /* PM -- Privacy Message */
-	case ']': /* OSC -- Operating System Command */
-	case 'k': /* old title set compatibility */
-		tstrsequence(ascii);
-		return 0;
 	case 'n': /* LS2 -- Locking shift 2 */
 	case 'o': /* LS3 -- Locking shift 3 */
-		term.charset = 2 + (ascii - 'n');
+		term->charset = 2 + (ascii - 'n');
 		break;
-	case '(': /* GZD4 -- set primary charset G0 */
-	case ')': /* G1D4 -- set secondary charset G1 */
-	case '*': /* G2D4 -- set tertiary charset G2 */
-	case '+': /* G3D4 -- set quaternary charset G3 */
-		term.icharset = ascii - '(';
-		term.esc |= ESC_ALTCHARSET;
-		return 0;
 	case 'D': /* IND -- Linefeed */
-		if (term.c.y == term.bot) {
-			tscrollup(term.top, 1);
+		if (term->c.y == term->bot) {
+			tscrollup(term->top, 1);
 		} else {
-			tmoveto(term.c.x, term.c.y+1);
+			tmoveto(term->c.x, term->c.y+1);
 		}
 		break;
 	case 'E': /* NEL -- Next line */
 		tnewline(1); /* always go to first col */
 		break;
 	case 'H': /* HTS -- Horizontal tab stop */
-		term.tabs[term.c.x] = 1;
+		term->tabs[term->c.x] = 1;
 		break;
 	case 'M': /* RI -- Reverse index */
-		if (term.c.y == term.top) {
-			tscrolldown(term.top, 1);
+		if (term->c.y == term->top) {
+			tscrolldown(term->top, 1);
 		} else {
-			tmoveto(term.c.x, term.c.y-1);
+			tmoveto(term->c.x, term->c.y-1);
 		}
 		break;
 	case 'Z': /* DECID -- Identify Terminal */
@@ -2812,10 +4593,10 @@ eschandle(uchar ascii)
 		wlloadcols();
 		break;
 	case '=': /* DECPAM -- Application keypad */
-		term.mode |= MODE_APPKEYPAD;
+		term->mode |= MODE_APPKEYPAD;
 		break;
 	case '>': /* DECPNM -- Normal keypad */
-		term.mode &= ~MODE_APPKEYPAD;
+		term->mode &= ~MODE_APPKEYPAD;
 		break;
 	case '7': /* DECSC -- Save Cursor */
 		tcursor(CURSOR_SAVE);
@@ -2824,7 +4605,7 @@ eschandle(uchar ascii)
 		tcursor(CURSOR_LOAD);
 		break;
 	case '\\': /* ST -- String Terminator */
-		if (term.esc & ESC_STR_END)
+		if (term->esc & ESC_STR_END)
 			strhandle();
 		break;
 	default:
@@ -2832,162 +4613,302 @@ eschandle(uchar ascii)
 			(uchar) ascii, isprint(ascii)? ascii:'.');
 		break;
 	}
-	return 1;
 }
 
+/* class of every 7-bit character, see enum char_class */
+static const uchar asciiclass[128] = {
+#define X CC_CTRL
+#define I CC_INTER
+#define F CC_FINAL
+	X, X, X, X, X, X, X, CC_BEL, X, X, X, X, X, X, X, X,
+	X, X, X, X, X, X, X, X, CC_CAN, X, CC_CAN, CC_ESC, X, X, X, X,
+	I, I, I, CC_TEST, I, CC_UTF8, I, I,
+	CC_CHARSET, CC_CHARSET, CC_CHARSET, CC_CHARSET, I, I, I, I,
+	I, I, I, I, I, I, I, I, I, I, I, I, I, I, I, I,
+	F, F, F, F, F, F, F, F, F, F, F, F, F, F, F, F,
+	CC_STR, F, F, F, F, F, F, F,
+	F, F, F, CC_CSI, F, CC_STR, CC_STR, CC_STR,
+	F, F, F, F, F, F, F, F, F, F, F, CC_STR, F, F, F, F,
+	F, F, F, F, F, F, F, F, F, F, F, F, F, F, F, X,
+#undef X
+#undef I
+#undef F
+};
+
+/*
+ * DEC-ANSI style transition table: the action for each state and
+ * character class in the high nibble, the next state in the low one.
+ * Control characters are executed without leaving the current state,
+ * except in ESC_STR where they belong to the string or terminate it.
+ */
+#define T(a, s)	((a) << 4 | (s))
+#define CONTROLS(s) \
+	T(EA_EXEC, s), T(EA_EXEC, s), T(EA_EXEC, s), T(EA_ESC, ESC_START), \
+	T(EA_EXEC, s), T(EA_STRSTART, ESC_STR)
+#define ALL(a, s) \
+	T(a, s), T(a, s), T(a, s), T(a, s), T(a, s), T(a, s), T(a, s)
+static const uchar esctable[ESC_NSTATES][CC_NCLASSES] = {
+	[ESC_GROUND] = {
+		T(EA_PRINT, ESC_GROUND), CONTROLS(ESC_GROUND),
+		T(EA_PRINT, ESC_GROUND), T(EA_PRINT, ESC_GROUND),
+		T(EA_PRINT, ESC_GROUND), T(EA_PRINT, ESC_GROUND),
+		T(EA_PRINT, ESC_GROUND), T(EA_PRINT, ESC_GROUND),
+		T(EA_PRINT, ESC_GROUND),
+	},
+	[ESC_START] = {
+		T(EA_ESCDISPATCH, ESC_GROUND), CONTROLS(ESC_START),
+		T(EA_ESCDISPATCH, ESC_GROUND), T(EA_ESCDISPATCH, ESC_GROUND),
+		T(EA_NONE, ESC_CSI), T(EA_NONE, ESC_TEST),
+		T(EA_NONE, ESC_UTF8), T(EA_SELCHARSET, ESC_ALTCHARSET),
+		T(EA_STRSTART, ESC_STR),
+	},
+	[ESC_CSI] = {
+		T(EA_COLLECT, ESC_CSI), CONTROLS(ESC_CSI),
+		T(EA_COLLECT, ESC_CSI), T(EA_CSIDISPATCH, ESC_GROUND),
+		T(EA_CSIDISPATCH, ESC_GROUND), T(EA_COLLECT, ESC_CSI),
+		T(EA_COLLECT, ESC_CSI), T(EA_COLLECT, ESC_CSI),
+		T(EA_CSIDISPATCH, ESC_GROUND),
+	},
+	[ESC_STR] = {
+		T(EA_STRPUT, ESC_STR), T(EA_STRPUT, ESC_STR),
+		T(EA_STREND, ESC_GROUND), T(EA_STREND, ESC_GROUND),
+		T(EA_STREND, ESC_GROUND), T(EA_STREND, ESC_GROUND),
+		T(EA_STREND, ESC_GROUND), ALL(EA_STRPUT, ESC_STR),
+	},
+	[ESC_ALTCHARSET] = {
+		T(EA_CHARSET, ESC_GROUND), CONTROLS(ESC_ALTCHARSET),
+		ALL(EA_CHARSET, ESC_GROUND),
+	},
+	[ESC_TEST] = {
+		T(EA_TEST, ESC_GROUND), CONTROLS(ESC_TEST),
+		ALL(EA_TEST, ESC_GROUND),
+	},
+	[ESC_UTF8] = {
+		T(EA_UTF8, ESC_GROUND), CONTROLS(ESC_UTF8),
+		ALL(EA_UTF8, ESC_GROUND),
+	},
+};
+#undef T
+#undef CONTROLS
+#undef ALL
+
 void
 tputc(Rune u)
 {
 	char c[UTF_SIZ];
-	int control;
-	int width, len;
-	Glyph *gp;
+	int width, len, cls, t;
+	size_t i;
+
+	if (u < 0x80)
+		cls = asciiclass[u];
+	else if (u < 0xA0)
+		cls = (u == 0x90 || u >= 0x9d) ? CC_STRC1 : CC_C1;
+	else
+		cls = CC_PRINT;
 
-	control = ISCONTROL(u);
 	if (!IS_SET(MODE_UTF8) && !IS_SET(MODE_SIXEL)) {
 		c[0] = u;
 		width = len = 1;
 	} else {
 		len = utf8encode(u, c);
-		if (!control && (width = wcwidth(u)) == -1) {
+		width = 1;
+		if (cls == CC_PRINT && (width = wcwidth(u)) == -1) {
 			memcpy(c, "\357\277\275", 4); /* UTF_INVALID */
 			width = 1;
 		}
 	}
 
-	if (IS_SET(MODE_PRINT))
+	if (IS_SET(MODE_PRINT) && !printraw)
 		tprinter(c, len);
 
-	/*
-	 * STR sequence must be checked before anything else
-	 * because it uses all following characters until it
-	 * receives a ESC, a SUB, a ST or any other C1 control
-	 * character.
-	 */
-	if (term.esc & ESC_STR) {
-		if (u == '\a' || u == 030 || u == 032 || u == 033 ||
-		    ISCONTROLC1(u)) {
-			term.esc &= ~(ESC_START|ESC_STR|ESC_DCS);
-			if (IS_SET(MODE_SIXEL)) {
-				/* TODO: render sixel */;
-				term.mode &= ~MODE_SIXEL;
-				return;
-			}
-			term.esc |= ESC_STR_END;
-			goto check_control_code;
-		}
-
+again:
+	t = esctable[term->esc & ESC_STATE][cls];
+	term->esc = (term->esc & ~ESC_STATE) | (t & ESC_STATE);
 
-		if (IS_SET(MODE_SIXEL)) {
-			/* TODO: implement sixel mode */
-			return;
-		}
-		if (term.esc&ESC_DCS && strescseq.len == 0 && u == 'q')
-			term.mode |= MODE_SIXEL;
-
-		if (strescseq.len+len >= sizeof(strescseq.buf)-1) {
-			/*
-			 * Here is a bug in terminals. If the user never sends
-			 * some code to stop the str or esc command, then st
-			 * will stop responding. But this is better than
-			 * silently failing with unknown characters. At least
-			 * then users will report back.
-			 *
-			 * In the case users ever get fixed, here is the code:
-			 */
-			/*
-			 * term.esc = 0;
-			 * strhandle();
-			 */
-			return;
-		}
-
-		memmove(&strescseq.buf[strescseq.len], c, len);
-		strescseq.len += len;
-		return;
-	}
-
-check_control_code:
-	/*
-	 * Actions of control codes must be performed as soon they arrive
-	 * because they can be embedded inside a control sequence, and
-	 * they must not cause conflicts with sequences.
-	 */
-	if (control) {
+	switch (t >> 4) {
+	case EA_PRINT:
+		tputglyph(u, width);
+		break;
+	case EA_EXEC:
+		/*
+		 * Actions of control codes must be performed as soon they
+		 * arrive because they can be embedded inside a control
+		 * sequence, and they must not cause conflicts with
+		 * sequences.
+		 */
 		tcontrolcode(u);
+		break;
+	case EA_ESC:
+		csireset();
+		break;
+	case EA_STRSTART:
+		tstrsequence(u);
+		break;
+	case EA_ESCDISPATCH:
+		eschandle(u);
+		term->esc = 0;
+		break;
+	case EA_COLLECT:
+	case EA_CSIDISPATCH:
+		csiescseq->buf[csiescseq->len++] = u;
+		if (t >> 4 == EA_COLLECT &&
+		    csiescseq->len < sizeof(csiescseq->buf)-1)
+			break;
+		term->esc = 0;
+		csiparse();
+		csihandle();
+		break;
+	case EA_SELCHARSET:
+		/* GZD4, G1D4, G2D4, G3D4 -- set G0-G3 charset */
+		term->icharset = u - '(';
+		break;
+	case EA_CHARSET:
+		tdeftran(u);
+		term->esc = 0;
+		break;
+	case EA_TEST:
+		tdectest(u);
+		term->esc = 0;
+		break;
+	case EA_UTF8:
+		tdefutf8(u);
+		term->esc = 0;
+		break;
+	case EA_STRPUT:
 		/*
-		 * control codes are not shown ever
+		 * STR sequence uses all following characters until it
+		 * receives a ESC, a SUB, a ST or any other C1 control
+		 * character.
 		 */
-		return;
-	} else if (term.esc & ESC_START) {
-		if (term.esc & ESC_CSI) {
-			csiescseq.buf[csiescseq.len++] = u;
-			if (BETWEEN(u, 0x40, 0x7E)
-					|| csiescseq.len >= \
-					sizeof(csiescseq.buf)-1) {
-				term.esc = 0;
-				csiparse();
-				csihandle();
-			}
-			return;
-		} else if (term.esc & ESC_UTF8) {
-			tdefutf8(u);
-		} else if (term.esc & ESC_ALTCHARSET) {
-			tdeftran(u);
-		} else if (term.esc & ESC_TEST) {
-			tdectest(u);
-		} else {
-			if (!eschandle(u))
-				return;
-			/* sequence already finished */
+		if (IS_SET(MODE_SIXEL)) {
+			sixelwrite((uchar *)c, len);
+			break;
 		}
-		term.esc = 0;
 		/*
-		 * All characters which form part of a sequence are not
-		 * printed
+		 * Sixel data follows a q after numeric parameters. The
+		 * buffer is not terminated, only len bytes of it are ours.
 		 */
-		return;
+		if (term->esc&ESC_DCS && u == 'q') {
+			for (i = 0; i < strescseq->len; i++) {
+				if (!BETWEEN(strescseq->buf[i], '0', '9') &&
+				    strescseq->buf[i] != ';')
+					break;
+			}
+			if (i == strescseq->len) {
+				sixelstart();
+				break;
+			}
+		}
+		strput(c, len);
+		break;
+	case EA_STREND:
+		term->esc &= ~ESC_DCS;
+		/* the terminator itself is handled from the ground state */
+		if (IS_SET(MODE_SIXEL))
+			sixelend(cls == CC_CAN);
+		else
+			term->esc |= ESC_STR_END;
+		goto again;
 	}
-	if (sel.ob.x != -1 && BETWEEN(term.c.y, sel.ob.y, sel.oe.y))
+}
+
+void
+tputglyph(Rune u, int width)
+{
+	Glyph *gp;
+
+	if (sel.ob.x != -1 && BETWEEN(term->c.y, sel.ob.y, sel.oe.y))
 		selclear();
 
-	gp = &term.line[term.c.y][term.c.x];
-	if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
+	gp = &term->line[term->c.y][term->c.x];
+	if (IS_SET(MODE_WRAP) && (term->c.state & CURSOR_WRAPNEXT)) {
 		gp->mode |= ATTR_WRAP;
 		tnewline(1);
-		gp = &term.line[term.c.y][term.c.x];
+		gp = &term->line[term->c.y][term->c.x];
 	}
 
-	if (IS_SET(MODE_INSERT) && term.c.x+width < term.col)
-		memmove(gp+width, gp, (term.col - term.c.x - width) * sizeof(Glyph));
+	if (IS_SET(MODE_INSERT) && term->c.x+width < term->col) {
+		/* as in tinsertblank(), the copies are overwritten below */
+		imgunref(&term->line[term->c.y][term->col-width], width);
+		memmove(gp+width, gp, (term->col - term->c.x - width) * sizeof(Glyph));
+		imgref(gp, width);
+	}
 
-	if (term.c.x+width > term.col) {
+	if (term->c.x+width > term->col) {
 		tnewline(1);
-		gp = &term.line[term.c.y][term.c.x];
+		gp = &term->line[term->c.y][term->c.x];
 	}
 
-	tsetchar(u, &term.c.attr, term.c.x, term.c.y);
+	tsetchar(u, &term->c.attr, term->c.x, term->c.y);
 
 	if (width == 2) {
 		gp->mode |= ATTR_WIDE;
-		if (term.c.x+1 < term.col) {
+		if (term->c.x+1 < term->col) {
+			imgunref(&gp[1], 1);
 			gp[1].u = '\0';
 			gp[1].mode = ATTR_WDUMMY;
 		}
 	}
-	if (term.c.x+width < term.col) {
-		tmoveto(term.c.x+width, term.c.y);
+	if (term->c.x+width < term->col) {
+		tmoveto(term->c.x+width, term->c.y);
 	} else {
-		term.c.state |= CURSOR_WRAPNEXT;
+		term->c.state |= CURSOR_WRAPNEXT;
+	}
+}
+
+/*
+ * Feed a buffer to the parser and return the number of bytes used; an
+ * incomplete UTF-8 sequence at the end is left for the next call.
+ */
+int
+twrite(const char *buf, int buflen)
+{
+	const uchar *p = (const uchar *)buf, *end = p + buflen, *q;
+	int charsize;
+	Rune u;
+
+	while (p < end) {
+		/* plain text needs neither decoding nor the table */
+		if ((term->esc & ESC_STATE) == ESC_GROUND &&
+		    (!IS_SET(MODE_PRINT) || printraw)) {
+			while (p < end && BETWEEN(*p, 0x20, 0x7E))
+				tputglyph(*p++, 1);
+			if (p == end)
+				break;
+		}
+		/* so are the bulk of OSC strings and sixel images */
+		if ((term->esc & ESC_STATE) == ESC_STR &&
+		    (!IS_SET(MODE_PRINT) || printraw) &&
+		    (IS_SET(MODE_SIXEL) || !(term->esc & ESC_DCS))) {
+			for (q = p; q < end && BETWEEN(*q, 0x20, 0x7E); q++)
+				;
+			if (IS_SET(MODE_SIXEL))
+				sixelwrite(p, q - p);
+			else
+				strput((const char *)p, q - p);
+			if ((p = q) == end)
+				break;
+		}
+		if (IS_SET(MODE_UTF8) && !IS_SET(MODE_SIXEL)) {
+			/* process a complete utf8 char */
+			charsize = utf8decode((char *)p, &u, end - p);
+			if (charsize == 0)
+				break;
+			tputc(u);
+			p += charsize;
+		} else {
+			tputc(*p++);
+		}
 	}
+	return p - (const uchar *)buf;
 }
 
 void
 tresize(int col, int row)
 {
 	int i;
-	int minrow = MIN(row, term.row);
-	int mincol = MIN(col, term.col);
+	int minrow = MIN(row, term->row);
+	int mincol = MIN(col, term->col);
 	int *bp;
 	TCursor c;
 
@@ -3002,55 +4923,87 @@ tresize(int col, int row)
 	 * tscrollup would work here, but we can optimize to
 	 * memmove because we're freeing the earlier lines
 	 */
-	for (i = 0; i <= term.c.y - row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
+	for (i = 0; i <= term->c.y - row; i++) {
+		imgunref(term->line[i], term->col);
+		imgunref(term->alt[i], term->col);
+		free(term->line[i]);
+		free(term->alt[i]);
 	}
 	/* ensure that both src and dst are not NULL */
 	if (i > 0) {
-		memmove(term.line, term.line + i, row * sizeof(Line));
-		memmove(term.alt, term.alt + i, row * sizeof(Line));
+		memmove(term->line, term->line + i, row * sizeof(Line));
+		memmove(term->alt, term->alt + i, row * sizeof(Line));
+		memmove(term->blink, term->blink + i, row * sizeof(*term->blink));
+		memmove(term->altblink, term->altblink + i,
+		        row * sizeof(*term->altblink));
 	}
-	for (i += row; i < term.row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
+	for (i += row; i < term->row; i++) {
+		imgunref(term->line[i], term->col);
+		imgunref(term->alt[i], term->col);
+		free(term->line[i]);
+		free(term->alt[i]);
 	}
 
+	/* cached matches are rescanned at the new size */
+	for (i = 0; i < term->row; i++)
+		free(term->hint[i].h);
+	term->hint = xrealloc(term->hint, row * sizeof(*term->hint));
+	for (i = 0; i < row; i++)
+		term->hint[i] = (HintLine){ .stale = 1 };
+
 	/* resize to new height */
-	term.line = xrealloc(term.line, row * sizeof(Line));
-	term.alt  = xrealloc(term.alt,  row * sizeof(Line));
-	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
-	term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
+	term->line = xrealloc(term->line, row * sizeof(Line));
+	term->alt  = xrealloc(term->alt,  row * sizeof(Line));
+	term->dirty = xrealloc(term->dirty, row * sizeof(*term->dirty));
+	term->blink = xrealloc(term->blink, row * sizeof(*term->blink));
+	term->altblink = xrealloc(term->altblink, row * sizeof(*term->altblink));
+	term->tabs = xrealloc(term->tabs, col * sizeof(*term->tabs));
 
-	/* resize each row to new width, zero-pad if needed */
+	/*
+	 * Resize each row to new width, zero-pad if needed: the new cells
+	 * are cleared below, which must not take them for images.
+	 */
 	for (i = 0; i < minrow; i++) {
-		term.line[i] = xrealloc(term.line[i], col * sizeof(Glyph));
-		term.alt[i]  = xrealloc(term.alt[i],  col * sizeof(Glyph));
+		if (col < term->col) {
+			imgunref(&term->line[i][col], term->col - col);
+			imgunref(&term->alt[i][col], term->col - col);
+		}
+		term->line[i] = xrealloc(term->line[i], col * sizeof(Glyph));
+		term->alt[i]  = xrealloc(term->alt[i],  col * sizeof(Glyph));
+		if (col > term->col) {
+			memset(&term->line[i][term->col], 0,
+			       (col - term->col) * sizeof(Glyph));
+			memset(&term->alt[i][term->col], 0,
+			       (col - term->col) * sizeof(Glyph));
+		}
 	}
 
 	/* allocate any new rows */
 	for (/* i == minrow */; i < row; i++) {
-		term.line[i] = xmalloc(col * sizeof(Glyph));
-		term.alt[i] = xmalloc(col * sizeof(Glyph));
+		term->line[i] = xmalloc(col * sizeof(Glyph));
+		term->alt[i] = xmalloc(col * sizeof(Glyph));
+		memset(term->line[i], 0, col * sizeof(Glyph));
+		memset(term->alt[i], 0, col * sizeof(Glyph));
+		term->blink[i] = term->altblink[i] = 0;
 	}
-	if (col > term.col) {
-		bp = term.tabs + term.col;
+	if (col > term->col) {
+		bp = term->tabs + term->col;
 
-		memset(bp, 0, sizeof(*term.tabs) * (col - term.col));
-		while (--bp > term.tabs && !*bp)
+		memset(bp, 0, sizeof(*term->tabs) * (col - term->col));
+		while (--bp > term->tabs && !*bp)
 			/* nothing */ ;
-		for (bp += tabspaces; bp < term.tabs + col; bp += tabspaces)
+		for (bp += tabspaces; bp < term->tabs + col; bp += tabspaces)
 			*bp = 1;
 	}
 	/* update terminal size */
-	term.col = col;
-	term.row = row;
+	term->col = col;
+	term->row = row;
 	/* reset scrolling region */
 	tsetscroll(0, row-1);
 	/* make use of the LIMIT in tmoveto */
-	tmoveto(term.c.x, term.c.y);
+	tmoveto(term->c.x, term->c.y);
 	/* Clearing both screens (it makes dirty all lines) */
-	c = term.c;
+	c = term->c;
 	for (i = 0; i < 2; i++) {
 		if (mincol < col && 0 < minrow) {
 			tclearregion(mincol, 0, col - 1, minrow - 1);
@@ -3061,7 +5014,7 @@ tresize(int col, int row)
 		tswapscreen();
 		tcursor(CURSOR_LOAD);
 	}
-	term.c = c;
+	term->c = c;
 }
 
 void
@@ -3069,14 +5022,14 @@ wlresize(int col, int row)
 {
 	union wld_object object;
 
-	wl.tw = MAX(1, col * wl.cw);
-	wl.th = MAX(1, row * wl.ch);
+	win->tw = MAX(1, col * wl.cw);
+	win->th = MAX(1, row * wl.ch);
 
-	wld.oldbuffer = wld.buffer;
-	wld.buffer = wld_create_buffer(wld.ctx, wl.w, wl.h,
+	win->oldbuffer = win->buffer;
+	win->buffer = wld_create_buffer(wld.ctx, win->w, win->h,
 			WLD_FORMAT_XRGB8888, 0);
-	wld_export(wld.buffer, WLD_WAYLAND_OBJECT_BUFFER, &object);
-	wl.buffer = object.ptr;
+	wld_export(win->buffer, WLD_WAYLAND_OBJECT_BUFFER, &object);
+	win->wlbuffer = object.ptr;
 }
 
 uchar
@@ -3117,6 +5070,7 @@ wlloadcols(void)
 			else
 				die("Could not allocate color %d\n", i);
 		}
+	colorgen++;
 }
 
 int
@@ -3131,6 +5085,7 @@ wlsetcolorname(int x, const char *name)
 		return 1;
 
 	dc.col[x] = color;
+	colorgen++;
 
 	return 0;
 }
@@ -3156,7 +5111,7 @@ wlclear(int x1, int y1, int x2, int y2)
 {
 	uint32_t color = dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg];
 
-	wld_fill_rectangle(wld.renderer, color, x1, y1, x2 - x1, y2 - y1);
+	dlfill(DL_BG, color, x1, y1, x2 - x1, y2 - y1);
 }
 
 int
@@ -3288,32 +5243,354 @@ wlloadfonts(char *fontstr, double fontsize)
 	/* Setting character width and height. */
 	wl.cw = ceilf(dc.font.width * cwscale);
 	wl.ch = ceilf(dc.font.height * chscale);
+	wlboxinit();
 
-	FcPatternDel(pattern, FC_SLANT);
-	FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
-	if (wlloadfont(&dc.ifont, pattern))
-		die("st: can't open font %s\n", fontstr);
+	/* bold and italic are opened by wlloadvariant() when needed */
+	dc.pattern = pattern;
+}
 
-	FcPatternDel(pattern, FC_WEIGHT);
-	FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
-	if (wlloadfont(&dc.ibfont, pattern))
-		die("st: can't open font %s\n", fontstr);
+Font *
+wlloadvariant(int frcflags)
+{
+	Font *f;
+	FcPattern *pattern;
+	int slant = FC_SLANT_ROMAN, weight = -1;
 
-	FcPatternDel(pattern, FC_SLANT);
-	FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ROMAN);
-	if (wlloadfont(&dc.bfont, pattern))
-		die("st: can't open font %s\n", fontstr);
+	switch (frcflags) {
+	case FRC_ITALIC:
+		f = &dc.ifont;
+		slant = FC_SLANT_ITALIC;
+		break;
+	case FRC_BOLD:
+		f = &dc.bfont;
+		weight = FC_WEIGHT_BOLD;
+		break;
+	case FRC_ITALICBOLD:
+		f = &dc.ibfont;
+		slant = FC_SLANT_ITALIC;
+		weight = FC_WEIGHT_BOLD;
+		break;
+	default:
+		return &dc.font;
+	}
+	if (f->match)
+		return f;
 
+	pattern = FcPatternDuplicate(dc.pattern);
+	FcPatternDel(pattern, FC_SLANT);
+	FcPatternAddInteger(pattern, FC_SLANT, slant);
+	if (weight >= 0) {
+		FcPatternDel(pattern, FC_WEIGHT);
+		FcPatternAddInteger(pattern, FC_WEIGHT, weight);
+	}
+	if (wlloadfont(f, pattern))
+		die("st: can't open font %s\n", usedfont);
 	FcPatternDestroy(pattern);
+
+	startstep(STEP_IFONT + frcflags - FRC_ITALIC);
+	return f;
+}
+
+/*
+ * Whether the font has a glyph for u, loading it if so. The answer for
+ * the common runes is kept, so a redraw does not look every cell up in
+ * the font's character map again.
+ */
+int
+wlhaschar(Font *f, Rune u)
+{
+	uchar *p, bits;
+
+	if (u >= GLYPH_CACHE_RUNES)
+		return wld_font_ensure_char(f->match, u);
+	if (!f->glyphs) {
+		f->glyphs = xmalloc(GLYPH_CACHE_RUNES / 4);
+		memset(f->glyphs, 0, GLYPH_CACHE_RUNES / 4);
+	}
+	p = &f->glyphs[u / 4];
+	bits = *p >> (u % 4 * 2) & 3;
+	if (!bits) {
+		bits = wld_font_ensure_char(f->match, u) ? 3 : 1;
+		*p |= bits << (u % 4 * 2);
+	}
+	return bits == 3;
+}
+
+/* Whether the glyph of u, drawn at its own advance, ends after w pixels */
+int
+wlglyphfits(struct wld_font *f, Rune u, int w)
+{
+	struct wld_extents extents;
+	char buf[UTF_SIZ];
+
+	wld_font_text_extents_n(f, buf, utf8encode(u, buf), &extents);
+	return extents.advance == w;
+}
+
+/*
+ * Lay out the box-drawing and block characters for the current cell size.
+ * Lines are given by the weight of their arms, one nibble each for up,
+ * right, down and left: 1 light, 2 heavy, 3 double. Arcs are drawn as
+ * corners, the dashed lines are laid out below and the diagonals are left
+ * to the font.
+ */
+void
+wlboxinit(void)
+{
+	static const ushort arms[0x80] = {
+		0x0101, 0x0202, 0x1010, 0x2020, 0, 0, 0, 0,
+		0, 0, 0, 0, 0x0110, 0x0210, 0x0120, 0x0220,
+		0x0011, 0x0012, 0x0021, 0x0022, 0x1100, 0x1200, 0x2100, 0x2200,
+		0x1001, 0x1002, 0x2001, 0x2002, 0x1110, 0x1210, 0x2110, 0x1120,
+		0x2120, 0x2210, 0x1220, 0x2220, 0x1011, 0x1012, 0x2011, 0x1021,
+		0x2021, 0x2012, 0x1022, 0x2022, 0x0111, 0x0112, 0x0211, 0x0212,
+		0x0121, 0x0122, 0x0221, 0x0222, 0x1101, 0x1102, 0x1201, 0x1202,
+		0x2101, 0x2102, 0x2201, 0x2202, 0x1111, 0x1112, 0x1211, 0x1212,
+		0x2111, 0x1121, 0x2121, 0x2112, 0x2211, 0x1122, 0x1221, 0x2212,
+		0x1222, 0x2122, 0x2221, 0x2222, 0, 0, 0, 0,
+		0x0303, 0x3030, 0x0310, 0x0130, 0x0330, 0x0013, 0x0031, 0x0033,
+		0x1300, 0x3100, 0x3300, 0x1003, 0x3001, 0x3003, 0x1310, 0x3130,
+		0x3330, 0x1013, 0x3031, 0x3033, 0x0313, 0x0131, 0x0333, 0x1303,
+		0x3101, 0x3303, 0x1313, 0x3131, 0x3333, 0x0110, 0x0011, 0x1001,
+		0x1100, 0, 0, 0, 0x0001, 0x1000, 0x0100, 0x0010,
+		0x0002, 0x2000, 0x0200, 0x0020, 0x0201, 0x1020, 0x0102, 0x2010,
+	};
+	static const uchar quadrants[] = { 4, 8, 1, 13, 9, 7, 11, 2, 6, 14 };
+	int cw = wl.cw, ch = wl.ch, lw = MAX(1, MIN(cw, ch) / 8);
+	int i, j, k, d, n, t, w, len;
+	BoxRect tmp;
+	Box *b;
+
+	memset(boxes, 0, sizeof(boxes));
+	for (i = 0; i < LEN(arms); i++) {
+		for (d = 0; d < 4; d++) {
+			if (arms[i] >> (12 - 4 * d) & 0xF)
+				wlboxline(&boxes[i], arms[i], d, lw);
+		}
+	}
+
+	/* triple, quadruple and double dashes */
+	for (i = 0x04; i < 0x50; i++) {
+		if (i == 0x0C)
+			i = 0x4C;
+		b = &boxes[i];
+		n = i >= 0x4C ? 2 : i >= 0x08 ? 4 : 3;
+		t = i & 1 ? 2 * lw : lw;
+		len = i & 2 ? ch : cw;
+		for (j = 0; j < n; j++) {
+			k = len * j / n;
+			w = len * (j + 1) / n - k;
+			d = MAX(1, w / 3);
+			if (i & 2)
+				wlboxrect(b, (cw - t) / 2, k + d / 2, t, w - d);
+			else
+				wlboxrect(b, k + d / 2, (ch - t) / 2, w - d, t);
+		}
+	}
+
+	/* block elements */
+	wlboxrect(&boxes[0x80], 0, 0, cw, ch - (ch * 4 + 4) / 8);
+	for (i = 1; i <= 8; i++) {
+		k = (ch * i + 4) / 8;
+		wlboxrect(&boxes[0x80 + i], 0, ch - k, cw, k);
+	}
+	for (i = 1; i <= 7; i++)
+		wlboxrect(&boxes[0x90 - i], 0, 0, (cw * i + 4) / 8, ch);
+	k = (cw * 4 + 4) / 8;
+	wlboxrect(&boxes[0x90], k, 0, cw - k, ch);
+	for (i = 1; i <= 3; i++)
+		boxes[0x90 + i].shade = i;
+	wlboxrect(&boxes[0x94], 0, 0, cw, (ch + 4) / 8);
+	k = (cw + 4) / 8;
+	wlboxrect(&boxes[0x95], cw - k, 0, k, ch);
+	for (i = 0; i < LEN(quadrants); i++) {
+		b = &boxes[0x96 + i];
+		if (quadrants[i] & 1)
+			wlboxrect(b, 0, 0, cw / 2, ch / 2);
+		if (quadrants[i] & 2)
+			wlboxrect(b, cw / 2, 0, cw - cw / 2, ch / 2);
+		if (quadrants[i] & 4)
+			wlboxrect(b, 0, ch / 2, cw / 2, ch - ch / 2);
+		if (quadrants[i] & 8)
+			wlboxrect(b, cw / 2, ch / 2, cw - cw / 2, ch - ch / 2);
+	}
+
+	/*
+	 * Join the rectangles of a character that overlap in a row or a
+	 * column, so that a line across cells ends up as one fill.
+	 */
+	for (b = boxes; b < boxes + LEN(boxes); b++) {
+		for (i = 0; i < b->n; i++) {
+			for (j = i + 1; j < b->n; j++) {
+				if (b->r[i].y == b->r[j].y && b->r[i].h == b->r[j].h &&
+				    b->r[i].x <= b->r[j].x + b->r[j].w &&
+				    b->r[j].x <= b->r[i].x + b->r[i].w) {
+					k = MAX(b->r[i].x + b->r[i].w,
+					        b->r[j].x + b->r[j].w);
+					b->r[i].x = MIN(b->r[i].x, b->r[j].x);
+					b->r[i].w = k - b->r[i].x;
+				} else if (b->r[i].x == b->r[j].x &&
+				           b->r[i].w == b->r[j].w &&
+				           b->r[i].y <= b->r[j].y + b->r[j].h &&
+				           b->r[j].y <= b->r[i].y + b->r[i].h) {
+					k = MAX(b->r[i].y + b->r[i].h,
+					        b->r[j].y + b->r[j].h);
+					b->r[i].y = MIN(b->r[i].y, b->r[j].y);
+					b->r[i].h = k - b->r[i].y;
+				} else {
+					continue;
+				}
+				/* r[i] grew, so compare it with the rest again */
+				b->r[j] = b->r[--b->n];
+				j = i;
+			}
+		}
+		/*
+		 * Queue what touches the left edge first and what touches the
+		 * right edge last, for dlfill() to join with the neighbours.
+		 */
+		for (i = 1; i < b->n; i++) {
+			for (j = i; j > 0 && wlboxedge(&b->r[j - 1], cw) >
+			            wlboxedge(&b->r[j], cw); j--) {
+				tmp = b->r[j];
+				b->r[j] = b->r[j - 1];
+				b->r[j - 1] = tmp;
+			}
+		}
+	}
+}
+
+/*
+ * Add arm d of a line character. A light or heavy arm runs through the
+ * middle of the cell; a double arm is two light strokes, each ending
+ * where it meets the strokes of a crossing double line.
+ */
+void
+wlboxline(Box *b, int arms, int d, int lw)
+{
+	int w = arms >> (12 - 4 * d) & 0xF;
+	int far = arms >> (12 - 4 * ((d + 2) % 4)) & 0xF;
+	int horiz = d & 1, toward0 = d == 0 || d == 3;
+	int p0 = arms >> (horiz ? 12 : 0) & 0xF;
+	int p1 = arms >> (horiz ? 4 : 8) & 0xF;
+	int len = horiz ? wl.cw : wl.ch, wid = horiz ? wl.ch : wl.cw;
+	int a = (len - 3 * lw) / 2, bb = a + 2 * lw;
+	int tp = MAX(p0 == 3 ? 0 : p0 * lw, p1 == 3 ? 0 : p1 * lw);
+	int k, m, q, s, e, side, other, t;
+
+	for (k = 0; k < (w == 3 ? 2 : 1); k++) {
+		if (w == 3) {
+			t = lw;
+			q = (wid - 3 * lw) / 2 + 2 * lw * k;
+			side = k ? p1 : p0;
+			other = k ? p0 : p1;
+			m = MAX(tp, lw);
+			if (side == 3) {
+				s = bb;
+				e = a + lw;
+			} else if (other == 3) {
+				s = a;
+				e = bb + lw;
+			} else {
+				s = (len - m) / 2;
+				e = s + m;
+			}
+		} else {
+			t = w * lw;
+			q = (wid - t) / 2;
+			m = MAX(tp, t);
+			if (p0 == 3 && p1 == 3) {
+				/* stop at the near stroke unless crossing */
+				s = far ? a : bb;
+				e = (far ? bb : a) + lw;
+			} else if (p0 == 3 || p1 == 3) {
+				s = a;
+				e = bb + lw;
+			} else {
+				s = (len - m) / 2;
+				e = s + m;
+			}
+		}
+		if (toward0)
+			s = 0;
+		else
+			e = len;
+		if (horiz)
+			wlboxrect(b, s, q, e - s, t);
+		else
+			wlboxrect(b, q, s, t, e - s);
+	}
+}
+
+void
+wlboxrect(Box *b, int x, int y, int w, int h)
+{
+	/* tiny cells have no room for the double lines */
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
+	}
+	w = MIN(w, wl.cw - x);
+	h = MIN(h, wl.ch - y);
+	if (w <= 0 || h <= 0 || b->n == LEN(b->r))
+		return;
+	b->r[b->n].x = x;
+	b->r[b->n].y = y;
+	b->r[b->n].w = w;
+	b->r[b->n].h = h;
+	b->n++;
+}
+
+/* -1 if r touches only the left edge of the cell, 1 if only the right */
+int
+wlboxedge(const BoxRect *r, int cw)
+{
+	return (r->x + r->w == cw) - (r->x == 0);
+}
+
+int
+wlisbox(Rune u)
+{
+	return boxdraw && BETWEEN(u, 0x2500, 0x259F) &&
+	       (boxes[u - 0x2500].n || boxes[u - 0x2500].shade);
+}
+
+/* Queue box-drawing or block character u for the cell at x, y */
+void
+wldrawbox(Rune u, uint32_t fg, uint32_t bg, int x, int y)
+{
+	Box *b = &boxes[u - 0x2500];
+	uint32_t c = 0;
+	int i, sh;
+
+	if (b->shade) {
+		for (sh = 0; sh < 32; sh += 8) {
+			c |= ((fg >> sh & 0xFF) * b->shade +
+			      (bg >> sh & 0xFF) * (4 - b->shade)) / 4 << sh;
+		}
+		dlfill(DL_BOX, c, x, y, wl.cw, wl.ch);
+	}
+	for (i = 0; i < b->n; i++) {
+		dlfill(DL_BOX, fg, x + b->r[i].x, y + b->r[i].y, b->r[i].w,
+		       b->r[i].h);
+	}
 }
 
 void
 wlunloadfont(Font *f)
 {
+	if (!f->match)
+		return;
 	wld_font_close(f->match);
 	FcPatternDestroy(f->pattern);
 	if (f->set)
 		FcFontSetDestroy(f->set);
+	free(f->glyphs);
+	memset(f, 0, sizeof(*f));
 }
 
 void
@@ -3327,6 +5604,8 @@ wlunloadfonts(void)
 	wlunloadfont(&dc.bfont);
 	wlunloadfont(&dc.ifont);
 	wlunloadfont(&dc.ibfont);
+	FcPatternDestroy(dc.pattern);
+	dc.pattern = NULL;
 }
 
 void
@@ -3363,6 +5642,26 @@ wlzoomreset(const Arg *arg)
 	}
 }
 
+void
+painterinit(void)
+{
+	int i;
+
+	wld.renderer = wld_create_renderer(wld.ctx);
+	mainpainter.renderer = wld.renderer;
+	if (drawthreads > 1) {
+		npainters = drawthreads - 1;
+		painters = xmalloc(npainters * sizeof(*painters));
+		memset(painters, 0, npainters * sizeof(*painters));
+		for (i = 0; i < npainters; i++) {
+			painters[i].renderer = wld_create_renderer(wld.ctx);
+			if (pthread_create(&painters[i].thread, NULL,
+			                   drawworker, &painters[i]))
+				die("pthread_create failed\n");
+		}
+	}
+}
+
 void
 wlinit(void)
 {
@@ -3373,10 +5672,20 @@ wlinit(void)
 
 	registry = wl_display_get_registry(wl.dpy);
 	wl_registry_add_listener(registry, &reglistener, NULL);
-	wld.ctx = wld_wayland_create_context(wl.dpy, WLD_ANY);
-	wld.renderer = wld_create_renderer(wld.ctx);
+	/*
+	 * The DRM renderers are not safe to draw into one buffer from
+	 * several threads, wl_shm's pixman ones are.
+	 */
+	if (drawthreads > 1)
+		wld.ctx = wld_wayland_create_context(wl.dpy, WLD_SHM, WLD_NONE);
+	else
+		wld.ctx = wld_wayland_create_context(wl.dpy, WLD_ANY);
+	if (!wld.ctx)
+		die("Can't create wld context\n");
+	painterinit();
 
 	wl_display_roundtrip(wl.dpy);
+	startstep(STEP_DISPLAY);
 
 	if (!wl.shm)
 		die("Display has no SHM\n");
@@ -3402,68 +5711,42 @@ wlinit(void)
 	usedfont = (opt_font == NULL)? font : opt_font;
 	wld.fontctx = wld_font_create_context();
 	wlloadfonts(usedfont, 0);
+	startstep(STEP_FONT);
 
 	wlloadcols();
 	wlloadcursor();
 
-	wl.vis = 0;
-	wl.h = 2 * borderpx + term.row * wl.ch;
-	wl.w = 2 * borderpx + term.col * wl.cw;
-
-	wl.surface = wl_compositor_create_surface(wl.cmp);
-	wl_surface_add_listener(wl.surface, &surflistener, NULL);
-
-	wl.xdgsurface = xdg_wm_base_get_xdg_surface(wl.wm, wl.surface);
-	xdg_surface_add_listener(wl.xdgsurface, &xdgsurflistener, NULL);
-	wl.toplevel = xdg_surface_get_toplevel(wl.xdgsurface);
-	xdg_toplevel_add_listener(wl.toplevel, &toplevellistener, NULL);
-	xdg_toplevel_set_app_id(wl.toplevel, opt_class ? opt_class : termname);
+	/* for the first session, main() makes it */
+	win = winnew(MAX(cols, 1), MAX(rows, 1));
 
 	wl.xkb.ctx = xkb_context_new(0);
-	wlresettitle();
-	wl_surface_commit(wl.surface);
+	wl_surface_commit(win->surface);
+	startstep(STEP_WINDOW);
 }
 
 /*
- * TODO: Implement something like XftDrawGlyphFontSpec in wld, and then apply a
- * similar patch to ae1923d27533ff46400d93765e971558201ca1ee
+ * Final colours of a glyph: truecolor or palette, bold brightening,
+ * reverse video, faint, blink and invisible. Runs share few combinations,
+ * so the result is cached until the palette changes.
  */
-
 void
-wldraws(char *s, Glyph base, int x, int y, int charlen, int bytelen)
+wlresolvecolors(Glyph base, uint32_t *rfg, uint32_t *rbg)
 {
-	int winx = borderpx + x * wl.cw, winy = borderpx + y * wl.ch,
-	    width = charlen * wl.cw, xp, i;
-	int frcflags, charexists;
-	int u8fl, u8fblen, u8cblen, doesexist;
-	char *u8c, *u8fs;
-	Rune unicodep;
-	Font *font = &dc.font;
-	FcResult fcres;
-	FcPattern *fcpattern, *fontpattern;
-	FcFontSet *fcsets[] = { NULL };
-	FcCharSet *fccharset;
+	ColorCache *c;
 	uint32_t fg, bg, temp;
-	int oneatatime;
-
-	frcflags = FRC_NORMAL;
-
-	/* Fallback on color display for attributes not supported by the font */
-	if (base.mode & ATTR_ITALIC && base.mode & ATTR_BOLD) {
-		if (dc.ibfont.badslant || dc.ibfont.badweight)
-			base.fg = defaultattr;
-		font = &dc.ibfont;
-		frcflags = FRC_ITALICBOLD;
-	} else if (base.mode & ATTR_ITALIC) {
-		if (dc.ifont.badslant)
-			base.fg = defaultattr;
-		font = &dc.ifont;
-		frcflags = FRC_ITALIC;
-	} else if (base.mode & ATTR_BOLD) {
-		if (dc.bfont.badweight)
-			base.fg = defaultattr;
-		font = &dc.ifont;
-		frcflags = FRC_BOLD;
+	uint mode;
+
+	mode = (base.mode & (ATTR_BOLD|ATTR_FAINT|ATTR_BLINK|ATTR_REVERSE|
+	                     ATTR_INVISIBLE)) |
+	       (term->mode & (MODE_REVERSE|MODE_BLINK));
+	/* the top bits of the products depend on all the bits of each */
+	c = &painter->colors[(base.fg * 0x9E3779B1u ^ base.bg * 0x85EBCA77u ^
+	                      mode * 0xC2B2AE35u) >> 24 & (COLOR_CACHE_SIZ - 1)];
+	if (c->gen == colorgen && c->fg == base.fg && c->bg == base.bg &&
+	    c->mode == mode) {
+		*rfg = c->rfg;
+		*rbg = c->rbg;
+		return;
 	}
 
 	if (IS_TRUECOL(base.fg)) {
@@ -3478,22 +5761,13 @@ wldraws(char *s, Glyph base, int x, int y, int charlen, int bytelen)
 		bg = dc.col[base.bg];
 	}
 
-	if (base.mode & ATTR_BOLD) {
-		/*
-		 * change basic system colors [0-7]
-		 * to bright system colors [8-15]
-		 */
-		if (BETWEEN(base.fg, 0, 7) && !(base.mode & ATTR_FAINT))
-			fg = dc.col[base.fg + 8];
-
-		if (base.mode & ATTR_ITALIC) {
-			font = &dc.ibfont;
-			frcflags = FRC_ITALICBOLD;
-		} else {
-			font = &dc.bfont;
-			frcflags = FRC_BOLD;
-		}
-	}
+	/*
+	 * change basic system colors [0-7]
+	 * to bright system colors [8-15]
+	 */
+	if (base.mode & ATTR_BOLD && BETWEEN(base.fg, 0, 7) &&
+	    !(base.mode & ATTR_FAINT))
+		fg = dc.col[base.fg + 8];
 
 	if (IS_SET(MODE_REVERSE)) {
 		if (fg == dc.col[defaultfg]) {
@@ -3522,60 +5796,272 @@ wldraws(char *s, Glyph base, int x, int y, int charlen, int bytelen)
 			| ((fg & 0xff) / 2);
 	}
 
-	if (base.mode & ATTR_BLINK && term.mode & MODE_BLINK)
+	if (base.mode & ATTR_BLINK && term->mode & MODE_BLINK)
 		fg = bg;
 
 	if (base.mode & ATTR_INVISIBLE)
 		fg = bg;
 
-	/* Intelligent cleaning up of the borders. */
-	if (x == 0) {
-		wlclear(0, (y == 0)? 0 : winy, borderpx,
-			((y >= term.row-1)? wl.h : (winy + wl.ch)));
+	*c = (ColorCache){ base.fg, base.bg, mode, colorgen, fg, bg };
+	*rfg = fg;
+	*rbg = bg;
+}
+
+/*
+ * Queue a fill in one of the dl_layer layers. A fill continuing the last
+ * one of its layer on the same row extends it.
+ */
+void
+dlfill(int layer, uint32_t color, int x, int y, int w, int h)
+{
+	DrawList *dl = &painter->list;
+	DLFill **v = &dl->fill[layer];
+	int *n = &dl->nfill[layer];
+	int *siz = &dl->fillsiz[layer];
+	DLFill *last = *n > 0 ? &(*v)[*n - 1] : NULL;
+
+	if (w <= 0 || h <= 0)
+		return;
+	dl->queued++;
+	if (last && last->color == color && last->y == y && last->h == h &&
+	    last->x + last->w == x) {
+		last->w += w;
+		return;
 	}
-	if (x + charlen >= term.col) {
-		wlclear(winx + width, (y == 0)? 0 : winy, wl.w,
-			((y >= term.row-1)? wl.h : (winy + wl.ch)));
+	if (*n == *siz)
+		*v = xrealloc(*v, (*siz = MAX(2 * *siz, 64)) * sizeof(**v));
+	(*v)[(*n)++] = (DLFill){ x, y, w, h, color };
+}
+
+/*
+ * Queue a text run. A run starting where the last one ended, in the same
+ * font and colour, is appended to it; xend is where the run ends when the
+ * next one may be appended, -1 otherwise.
+ */
+void
+dltext(struct wld_font *font, uint32_t color, int x, int y, int xend,
+       const Rune *s, size_t n)
+{
+	DrawList *dl = &painter->list;
+	DLText *last = dl->ntext > 0 ? &dl->text[dl->ntext - 1] : NULL;
+	size_t i, len = 0;
+
+	dl->queued++;
+	if (dl->nstr + n * UTF_SIZ > dl->strsiz)
+		dl->str = xrealloc(dl->str, dl->strsiz = MAX(2 * dl->strsiz,
+		                   dl->nstr + n * UTF_SIZ + BUFSIZ));
+	/* wld takes UTF-8 */
+	for (i = 0; i < n; i++)
+		len += utf8encode(s[i], dl->str + dl->nstr + len);
+	if (last && last->xend == x && last->font == font &&
+	    last->color == color && last->y == y &&
+	    last->off + last->len == dl->nstr) {
+		last->len += len;
+		last->xend = xend;
+	} else {
+		if (dl->ntext == dl->textsiz)
+			dl->text = xrealloc(dl->text, (dl->textsiz =
+			            MAX(2 * dl->textsiz, 64)) * sizeof(*dl->text));
+		dl->text[dl->ntext] = (DLText){ font, color, x, y, xend,
+		                                dl->nstr, len, dl->ntext };
+		dl->ntext++;
 	}
-	if (y == 0)
-		wlclear(winx, 0, winx + width, borderpx);
-	if (y == term.row-1)
-		wlclear(winx, winy + wl.ch, winx + width, wl.h);
+	dl->nstr += len;
+}
 
-	/* Clean up the region we want to draw to. */
-	wld_fill_rectangle(wld.renderer, bg, winx, winy, width, wl.ch);
+void
+dlcopy(struct wld_buffer *buf, int dx, int dy, int sx, int sy, int w, int h)
+{
+	DrawList *dl = &painter->list;
 
-	for (xp = winx; bytelen > 0;) {
-		/*
-		 * Search for the range in the to be printed string of glyphs
-		 * that are in the main font. Then print that range. If
-		 * some glyph is found that is not in the font, do the
-		 * fallback dance.
-		 */
-		u8fs = s;
-		u8fblen = 0;
-		u8fl = 0;
-		oneatatime = font->width != wl.cw;
-		for (;;) {
-			u8c = s;
-			u8cblen = utf8decode(s, &unicodep, UTF_SIZ);
-			s += u8cblen;
-			bytelen -= u8cblen;
+	dl->queued++;
+	if (dl->ncopy == dl->copysiz)
+		dl->copy = xrealloc(dl->copy, (dl->copysiz =
+		            MAX(2 * dl->copysiz, 16)) * sizeof(*dl->copy));
+	dl->copy[dl->ncopy++] = (DLCopy){ buf, dx, dy, sx, sy, w, h };
+}
 
-			doesexist = wld_font_ensure_char(font->match, unicodep);
-			if (doesexist) {
-					u8fl++;
-					u8fblen += u8cblen;
-					if (!oneatatime && bytelen > 0)
-							continue;
+int
+dlfillcmp(const void *a, const void *b)
+{
+	const DLFill *f = a, *g = b;
+
+	if (f->color != g->color)
+		return f->color < g->color ? -1 : 1;
+	if (f->x != g->x)
+		return f->x - g->x;
+	if (f->w != g->w)
+		return f->w - g->w;
+	return f->y - g->y;
+}
+
+int
+dltextcmp(const void *a, const void *b)
+{
+	const DLText *s = a, *t = b;
+
+	if (s->font != t->font)
+		return (uintptr_t)s->font < (uintptr_t)t->font ? -1 : 1;
+	return s->idx - t->idx;
+}
+
+/*
+ * Draw fills, merging those of one colour stacked on consecutive rows.
+ * Sorting brings them together, but only the layers whose fills of
+ * different colours never overlap may be sorted: the decorations keep
+ * the order they came in.
+ */
+void
+dlsubmitfills(DLFill *v, int n, int sort)
+{
+	DLFill *f;
+	int i, j;
+
+	if (sort)
+		qsort(v, n, sizeof(*v), dlfillcmp);
+	for (i = 0; i < n; i = j) {
+		f = &v[i];
+		for (j = i + 1; j < n && v[j].color == f->color &&
+		     v[j].x == f->x && v[j].w == f->w &&
+		     v[j].y == f->y + f->h; j++)
+			f->h += v[j].h;
+		wld_fill_rectangle(painter->renderer, f->color, f->x, f->y,
+		                   f->w, f->h);
+		painter->list.calls++;
+	}
+}
+
+/*
+ * Run the queued operations: backgrounds first, merging fills stacked on
+ * the rows below each other, then images, then the text grouped by font,
+ * then the box-drawing characters merged like the backgrounds, then the
+ * lines drawn over it all. Neither backgrounds nor boxes of different
+ * colours overlap, each stays within its cells, so only this order
+ * between the kinds matters for them.
+ */
+void
+dlsubmit(void)
+{
+	DrawList *dl = &painter->list;
+	struct wld_renderer *r = painter->renderer;
+	int i;
+
+	dlsubmitfills(dl->fill[DL_BG], dl->nfill[DL_BG], 1);
+	for (i = 0; i < dl->ncopy; i++) {
+		wld_copy_rectangle(r, dl->copy[i].buf, dl->copy[i].dx,
+				dl->copy[i].dy, dl->copy[i].sx, dl->copy[i].sy,
+				dl->copy[i].w, dl->copy[i].h);
+		dl->calls++;
+	}
+	qsort(dl->text, dl->ntext, sizeof(*dl->text), dltextcmp);
+	for (i = 0; i < dl->ntext; i++) {
+		wld_draw_text(r, dl->text[i].font, dl->text[i].color,
+				dl->text[i].x, dl->text[i].y,
+				dl->str + dl->text[i].off, dl->text[i].len, NULL);
+		dl->calls++;
+	}
+	dlsubmitfills(dl->fill[DL_BOX], dl->nfill[DL_BOX], 1);
+	dlsubmitfills(dl->fill[DL_DECO], dl->nfill[DL_DECO], 0);
+	for (i = 0; i < DL_LAYERS; i++)
+		dl->nfill[i] = 0;
+	dl->ntext = dl->ncopy = 0;
+	dl->nstr = 0;
+}
+
+/*
+ * TODO: Implement something like XftDrawGlyphFontSpec in wld, and then apply a
+ * similar patch to ae1923d27533ff46400d93765e971558201ca1ee
+ *
+ * Until then, glyphs drawn one at a time are still queued with the cell
+ * they end at, and the draw list joins those whose own advance lands
+ * them on the grid, so a line of fallback or wide glyphs takes one call
+ * per font.
+ */
+
+void
+wldraws(const Rune *s, Glyph base, int x, int y, int charlen, int len)
+{
+	int winx = borderpx + x * wl.cw, winy = borderpx + y * wl.ch,
+	    width = charlen * wl.cw, xp, w, i;
+	int frcflags, charexists;
+	int fl, doesexist, isbox;
+	const Rune *fs;
+	Rune unicodep;
+	Font *font = &dc.font;
+	FcResult fcres;
+	FcPattern *fcpattern, *fontpattern;
+	FcFontSet *fcsets[] = { NULL };
+	FcCharSet *fccharset;
+	uint32_t fg, bg;
+	int oneatatime;
+
+	frcflags = FRC_NORMAL;
+
+	/* Fallback on color display for attributes not supported by the font */
+	if (base.mode & ATTR_ITALIC && base.mode & ATTR_BOLD) {
+		frcflags = FRC_ITALICBOLD;
+		font = wlloadvariant(frcflags);
+		if (font->badslant || font->badweight)
+			base.fg = defaultattr;
+	} else if (base.mode & ATTR_ITALIC) {
+		frcflags = FRC_ITALIC;
+		font = wlloadvariant(frcflags);
+		if (font->badslant)
+			base.fg = defaultattr;
+	} else if (base.mode & ATTR_BOLD) {
+		frcflags = FRC_BOLD;
+		font = wlloadvariant(frcflags);
+		if (font->badweight)
+			base.fg = defaultattr;
+	}
+
+	wlresolvecolors(base, &fg, &bg);
+
+	/* Intelligent cleaning up of the borders. */
+	if (x == 0) {
+		wlclear(0, (y == 0)? 0 : winy, borderpx,
+			((y >= term->row-1)? win->h : (winy + wl.ch)));
+	}
+	if (x + charlen >= term->col) {
+		wlclear(winx + width, (y == 0)? 0 : winy, win->w,
+			((y >= term->row-1)? win->h : (winy + wl.ch)));
+	}
+	if (y == 0)
+		wlclear(winx, 0, winx + width, borderpx);
+	if (y == term->row-1)
+		wlclear(winx, winy + wl.ch, winx + width, win->h);
+
+	/* Clean up the region we want to draw to. */
+	dlfill(DL_BG, bg, winx, winy, width, wl.ch);
+
+	for (xp = winx; len > 0;) {
+		/*
+		 * Search for the range in the to be printed string of glyphs
+		 * that are in the main font. Then print that range. If
+		 * some glyph is found that is not in the font, do the
+		 * fallback dance.
+		 */
+		fs = s;
+		fl = 0;
+		oneatatime = font->width != wl.cw;
+		for (;;) {
+			unicodep = *s++;
+			len--;
+
+			isbox = wlisbox(unicodep);
+			doesexist = !isbox && wlhaschar(font, unicodep);
+			if (doesexist) {
+					fl++;
+					if (!oneatatime && len > 0)
+							continue;
 			}
 
-			if (u8fl > 0) {
-				wld_draw_text(wld.renderer,
-						font->match, fg, xp,
-						winy + font->ascent,
-						u8fs, u8fblen, NULL);
-				xp += wl.cw * u8fl;
+			if (fl > 0) {
+				dltext(font->match, fg, xp, winy + font->ascent,
+				       (!oneatatime || wlglyphfits(font->match,
+				        *fs, wl.cw)) ? xp + wl.cw * fl : -1,
+				       fs, fl);
+				xp += wl.cw * fl;
 			}
 			break;
 		}
@@ -3585,6 +6071,12 @@ wldraws(char *s, Glyph base, int x, int y, int charlen, int bytelen)
 			break;
 		}
 
+		if (isbox) {
+			wldrawbox(unicodep, fg, bg, xp, winy);
+			xp += wl.cw;
+			continue;
+		}
+
 		/* Search the font cache. */
 		for (i = 0; i < frclen; i++) {
 			charexists = wld_font_ensure_char(frc[i].font, unicodep);
@@ -3648,32 +6140,65 @@ wldraws(char *s, Glyph base, int x, int y, int charlen, int bytelen)
 			FcCharSetDestroy(fccharset);
 		}
 
-		wld_draw_text(wld.renderer, frc[i].font, fg,
-				xp, winy + frc[i].font->ascent,
-				u8c, u8cblen, NULL);
+		w = wl.cw * wcwidth(unicodep);
+		dltext(frc[i].font, fg, xp, winy + frc[i].font->ascent,
+		       wlglyphfits(frc[i].font, unicodep, w) ? xp + w : -1,
+		       &unicodep, 1);
 
-		xp += wl.cw * wcwidth(unicodep);
+		xp += w;
 	}
 
-	if (base.mode & ATTR_UNDERLINE) {
-		wld_fill_rectangle(wld.renderer, fg, winx, winy + font->ascent + 1,
-				width, 1);
-	}
+	if (base.mode & ATTR_UNDERLINE)
+		dlfill(DL_DECO, fg, winx, winy + font->ascent + 1, width, 1);
 
-	if (base.mode & ATTR_STRUCK) {
-		wld_fill_rectangle(wld.renderer, fg, winx, winy + 2 * font->ascent / 3,
-				width, 1);
-	}
+	if (base.mode & ATTR_STRUCK)
+		dlfill(DL_DECO, fg, winx, winy + 2 * font->ascent / 3, width, 1);
 }
 
 void
 wldrawglyph(Glyph g, int x, int y)
 {
-	static char buf[UTF_SIZ];
-	size_t len = utf8encode(g.u, buf);
 	int width = g.mode & ATTR_WIDE ? 2 : 1;
 
-	wldraws(buf, g, x, y, width, len);
+	if (g.mode & ATTR_IMAGE) {
+		wldrawimage(g, x, y, 1);
+		return;
+	}
+	wldraws(&g.u, g, x, y, width, 1);
+}
+
+/* draw ncol tiles of the image of g, starting with the tile of g */
+void
+wldrawimage(Glyph g, int x, int y, int ncol)
+{
+	Image *im = &images[g.fg];
+	int winx = borderpx + x * wl.cw, winy = borderpx + y * wl.ch;
+	int tx = (g.bg >> 16) * wl.cw, ty = (g.bg & 0xFFFF) * wl.ch;
+	int w = MIN(ncol * wl.cw, im->w - tx), h = MIN(wl.ch, im->h - ty), i;
+	uchar *dst;
+
+	/* font size changes can leave parts of the cells uncovered */
+	dlfill(DL_BG, dc.col[defaultbg], winx, winy, ncol * wl.cw, wl.ch);
+	if (!im->px || w <= 0 || h <= 0)
+		return;
+
+	if (!im->buf) {
+		im->buf = wld_create_buffer(wld.ctx, im->w, im->h,
+				WLD_FORMAT_XRGB8888, WLD_FLAG_MAP);
+		if (!im->buf || !wld_map(im->buf)) {
+			fprintf(stderr, "could not upload a %dx%d image\n",
+				im->w, im->h);
+			if (im->buf)
+				wld_buffer_unreference(im->buf);
+			im->buf = NULL;
+			return;
+		}
+		dst = im->buf->map;
+		for (i = 0; i < im->h; i++, dst += im->buf->pitch)
+			memcpy(dst, &im->px[i * im->w], im->w * sizeof(*im->px));
+		wld_unmap(im->buf);
+	}
+	dlcopy(im->buf, winx, winy, tx, ty, w, h);
 }
 
 void
@@ -3685,28 +6210,29 @@ wldrawcursor(void)
 	int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
 	uint32_t drawcol;
 
-	LIMIT(oldx, 0, term.col-1);
-	LIMIT(oldy, 0, term.row-1);
+	LIMIT(oldx, 0, term->col-1);
+	LIMIT(oldy, 0, term->row-1);
 
-	curx = term.c.x;
+	curx = term->c.x;
 
 	/* adjust position if in dummy */
-	if (term.line[oldy][oldx].mode & ATTR_WDUMMY)
+	if (term->line[oldy][oldx].mode & ATTR_WDUMMY)
 		oldx--;
-	if (term.line[term.c.y][curx].mode & ATTR_WDUMMY)
+	if (term->line[term->c.y][curx].mode & ATTR_WDUMMY)
 		curx--;
 
 	/* remove the old cursor */
-	og = term.line[oldy][oldx];
+	og = term->line[oldy][oldx];
 	if (ena_sel && selected(oldx, oldy))
 		og.mode ^= ATTR_REVERSE;
 	wldrawglyph(og, oldx, oldy);
-	if (oldx != curx || oldy != term.c.y) {
-		wl_surface_damage(wl.surface, borderpx + oldx * wl.cw,
+	/* the new cursor is drawn over it */
+	dlsubmit();
+	if (win->surface) /* none when drawing offscreen with -B */
+		wl_surface_damage(win->surface, borderpx + oldx * wl.cw,
 				borderpx + oldy * wl.ch, wl.cw, wl.ch);
-	}
 
-	g.u = term.line[term.c.y][term.c.x].u;
+	g.u = term->line[term->c.y][term->c.x].u;
 
 	/*
 	 * Select the right color for the right mode.
@@ -3714,7 +6240,7 @@ wldrawcursor(void)
 	if (IS_SET(MODE_REVERSE)) {
 		g.mode |= ATTR_REVERSE;
 		g.bg = defaultfg;
-		if (ena_sel && selected(term.c.x, term.c.y)) {
+		if (ena_sel && selected(term->c.x, term->c.y)) {
 			drawcol = dc.col[defaultcs];
 			g.fg = defaultrcs;
 		} else {
@@ -3722,7 +6248,7 @@ wldrawcursor(void)
 			g.fg = defaultcs;
 		}
 	} else {
-		if (ena_sel && selected(term.c.x, term.c.y)) {
+		if (ena_sel && selected(term->c.x, term->c.y)) {
 			drawcol = dc.col[defaultrcs];
 			g.fg = defaultfg;
 			g.bg = defaultrcs;
@@ -3731,63 +6257,96 @@ wldrawcursor(void)
 		}
 	}
 
-	if (IS_SET(MODE_HIDE))
+	if (IS_SET(MODE_HIDE) || term->cursoroff)
 		return;
 
 	/* draw the new one */
-	if (wl.state & WIN_FOCUSED) {
-		switch (wl.cursor) {
+	if (win->state & WIN_FOCUSED) {
+		switch (term->cursor) {
 		case 7: /* st extension: snowman */
 			utf8decode("☃", &g.u, UTF_SIZ);
 		case 0: /* Blinking Block */
 		case 1: /* Blinking Block (Default) */
 		case 2: /* Steady Block */
-			g.mode |= term.line[term.c.y][curx].mode & ATTR_WIDE;
-			wldrawglyph(g, term.c.x, term.c.y);
+			g.mode |= term->line[term->c.y][curx].mode & ATTR_WIDE;
+			wldrawglyph(g, term->c.x, term->c.y);
 			break;
 		case 3: /* Blinking Underline */
 		case 4: /* Steady Underline */
-			wld_fill_rectangle(wld.renderer, drawcol,
+			dlfill(DL_DECO, drawcol,
 					borderpx + curx * wl.cw,
-					borderpx + (term.c.y + 1) * wl.ch - \
+					borderpx + (term->c.y + 1) * wl.ch - \
 						cursorthickness,
 					wl.cw, cursorthickness);
 			break;
 		case 5: /* Blinking bar */
 		case 6: /* Steady bar */
-			wld_fill_rectangle(wld.renderer, drawcol,
+			dlfill(DL_DECO, drawcol,
 					borderpx + curx * wl.cw,
-					borderpx + term.c.y * wl.ch,
+					borderpx + term->c.y * wl.ch,
 					cursorthickness, wl.ch);
 			break;
 		}
 	} else {
-		wld_fill_rectangle(wld.renderer, drawcol,
+		dlfill(DL_DECO, drawcol,
 				borderpx + curx * wl.cw,
-				borderpx + term.c.y * wl.ch,
+				borderpx + term->c.y * wl.ch,
 				wl.cw - 1, 1);
-		wld_fill_rectangle(wld.renderer, drawcol,
+		dlfill(DL_DECO, drawcol,
 				borderpx + curx * wl.cw,
-				borderpx + term.c.y * wl.ch,
+				borderpx + term->c.y * wl.ch,
 				1, wl.ch - 1);
-		wld_fill_rectangle(wld.renderer, drawcol,
+		dlfill(DL_DECO, drawcol,
 				borderpx + (curx + 1) * wl.cw - 1,
-				borderpx + term.c.y * wl.ch,
+				borderpx + term->c.y * wl.ch,
 				1, wl.ch - 1);
-		wld_fill_rectangle(wld.renderer, drawcol,
+		dlfill(DL_DECO, drawcol,
 				borderpx + curx * wl.cw,
-				borderpx + (term.c.y + 1) * wl.ch - 1,
+				borderpx + (term->c.y + 1) * wl.ch - 1,
 				wl.cw, 1);
 	}
-	wl_surface_damage(wl.surface, borderpx + curx * wl.cw,
-			borderpx + term.c.y * wl.ch, wl.cw, wl.ch);
-	oldx = curx, oldy = term.c.y;
+	dlsubmit();
+	if (win->surface)
+		wl_surface_damage(win->surface, borderpx + curx * wl.cw,
+				borderpx + term->c.y * wl.ch, wl.cw, wl.ch);
+	oldx = curx, oldy = term->c.y;
 }
 
 void
 wlsettitle(char *title)
 {
-	xdg_toplevel_set_title(wl.toplevel, title);
+	/* a session keeps its title, the window shows the shown one's */
+	free(loaded->title);
+	loaded->title = xstrdup(title ? title : "");
+	if (loaded == win->shown)
+		wlshowtitle();
+}
+
+/* the title of the loaded session's window */
+void
+wlshowtitle(void)
+{
+	Session *s = win->shown;
+	char *title;
+	int i, n, k;
+
+	if (!win->toplevel)
+		return;
+	for (i = 0, n = 0, k = 0; i < nsessions; i++) {
+		if (sessions[i]->win != win)
+			continue;
+		if (sessions[i] == s)
+			k = n;
+		n++;
+	}
+	if (n < 2) {
+		xdg_toplevel_set_title(win->toplevel, s->title);
+		return;
+	}
+	title = xmalloc(strlen(s->title) + 32);
+	sprintf(title, "[%d/%d] %s", k + 1, n, s->title);
+	xdg_toplevel_set_title(win->toplevel, title);
+	free(title);
 }
 
 void
@@ -3805,70 +6364,269 @@ redraw(void)
 void
 draw(void)
 {
-	int y, y0;
+	int i, y, y0, queued, keyframe, lines = 0;
+	struct wp_presentation_feedback *fb;
+	struct timespec *key;
 
-	for (y = 0; y <= term.bot; ++y) {
-		if (!term.dirty[y])
+	for (y = 0; y < term->row; ++y) {
+		if (!term->dirty[y])
 			continue;
-		for (y0 = y; y <= term.bot && term.dirty[y]; ++y);
-		wl_surface_damage(wl.surface, 0, borderpx + y0 * wl.ch,
-				wl.w, (y - y0) * wl.ch);
+		for (y0 = y; y < term->row && term->dirty[y]; ++y);
+		wl_surface_damage(win->surface, 0, borderpx + y0 * wl.ch,
+				win->w, (y - y0) * wl.ch);
+		lines += y - y0;
 	}
 
-	wld_set_target_buffer(wld.renderer, wld.buffer);
-	drawregion(0, 0, term.col, term.row);
-	wl.framecb = wl_surface_frame(wl.surface);
-	wl_callback_add_listener(wl.framecb, &framelistener, NULL);
+	wld_set_target_buffer(wld.renderer, win->buffer);
+	/* when only the cursor moved, repaint its old and new cells alone */
+	if (lines > 0)
+		drawregion(0, 0, term->col, term->row);
+	else
+		wldrawcursor();
+	if (opt_trace) {
+		tracecalls += drawstats(&queued);
+		traceops += queued;
+		traceframes++;
+	}
+	win->framecb = wl_surface_frame(win->surface);
+	wl_callback_add_listener(win->framecb, &framelistener, win);
 	wld_flush(wld.renderer);
-	wl_surface_attach(wl.surface, wl.buffer, 0, 0);
-	wl_surface_commit(wl.surface);
+	/* a key sent to the shell is shown once its echo is drawn */
+	keyframe = loaded == active && latset(&keylat.key) &&
+	           (!latset(&keylat.t[LAT_SEND]) ||
+	            latset(&keylat.t[LAT_ECHO]));
+	if (keyframe && wl.presentation) {
+		key = xmalloc(sizeof(*key));
+		*key = keylat.key;
+		fb = wp_presentation_feedback(wl.presentation, win->surface);
+		wp_presentation_feedback_add_listener(fb, &presfblistener, key);
+	}
+	wl_surface_attach(win->surface, win->wlbuffer, 0, 0);
+	wl_surface_commit(win->surface);
+	if (keyframe) {
+		latstamp(LAT_COMMIT);
+		for (i = LAT_SEND; i <= LAT_COMMIT; i++) {
+			if (latset(&keylat.t[i]))
+				latsample(i, &keylat.key, &keylat.t[i]);
+		}
+		memset(&keylat, 0, sizeof(keylat));
+		timerstop(&lattimer);
+	}
 	/* need to wait to destroy the old buffer until we commit the new
 	 * buffer */
-	if (wld.oldbuffer) {
-		wld_buffer_unreference(wld.oldbuffer);
-		wld.oldbuffer = 0;
+	if (win->oldbuffer) {
+		wld_buffer_unreference(win->oldbuffer);
+		win->oldbuffer = 0;
+	}
+	win->needdraw = false;
+	startstep(STEP_DRAW);
+}
+
+/* renderer calls and queued operations since the last call */
+int
+drawstats(int *queued)
+{
+	int i, calls;
+
+	*queued = mainpainter.list.queued;
+	calls = mainpainter.list.calls;
+	for (i = 0; i < npainters; i++) {
+		*queued += painters[i].list.queued;
+		calls += painters[i].list.calls;
+		painters[i].list.queued = painters[i].list.calls = 0;
 	}
-	needdraw = false;
+	mainpainter.list.queued = mainpainter.list.calls = 0;
+	return calls;
 }
 
 void
 drawregion(int x1, int y1, int x2, int y2)
 {
-	int ic, ib, x, y, ox;
-	Glyph base, new;
-	char buf[DRAW_BUF_SIZ];
-	int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
+	int y;
+
+	if (npainters > 0 && !loaded->hints.active)
+		drawbands(x1, y1, x2, y2);
 
 	for (y = y1; y < y2; y++) {
-		if (!term.dirty[y])
+		if (!term->dirty[y])
 			continue;
+		drawline(x1, x2, y);
+		if (loaded->hints.active) {
+			/* the hints cover the line */
+			dlsubmit();
+			hintdraw(y);
+			dlsubmit();
+		}
+	}
+	dlsubmit();
+	wldrawcursor();
+}
 
-		term.dirty[y] = 0;
-		base = term.line[y][0];
-		ic = ib = ox = 0;
-		for (x = x1; x < x2; x++) {
-			new = term.line[y][x];
-			if (new.mode == ATTR_WDUMMY)
-				continue;
-			if (ena_sel && selected(x, y))
-				new.mode ^= ATTR_REVERSE;
-			if (ib > 0 && (ATTRCMP(base, new)
-					|| ib >= DRAW_BUF_SIZ-UTF_SIZ)) {
+void
+drawline(int x1, int x2, int y)
+{
+	int ic, ib, x, ox, n;
+	Glyph base, new, *g;
+	Rune *buf;
+	int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
+
+	/* a run is at most a line, and the workers have small stacks */
+	if (painter->nrunes < term->col) {
+		painter->nrunes = term->col;
+		painter->runes = xrealloc(painter->runes,
+		                          term->col * sizeof(*painter->runes));
+	}
+	buf = painter->runes;
+	term->dirty[y] = 0;
+	term->hint[y].stale = 1;
+	base = term->line[y][0];
+	ic = ib = ox = 0;
+	for (x = x1; x < x2; x++) {
+		new = term->line[y][x];
+		if (new.mode == ATTR_WDUMMY)
+			continue;
+		if (new.mode & ATTR_IMAGE) {
+			if (ib > 0)
 				wldraws(buf, base, ox, y, ic, ib);
-				ic = ib = 0;
-			}
-			if (ib == 0) {
-				ox = x;
-				base = new;
+			ic = ib = 0;
+			/* blit adjacent tiles of the image at once */
+			for (n = 1; x + n < x2; n++) {
+				g = &term->line[y][x + n];
+				if (!(g->mode & ATTR_IMAGE) || g->fg != new.fg ||
+				    g->bg != new.bg + (n << 16))
+					break;
 			}
-
-			ib += utf8encode(new.u, buf+ib);
-			ic += (new.mode & ATTR_WIDE)? 2 : 1;
+			wldrawimage(new, x, y, n);
+			x += n - 1;
+			continue;
 		}
-		if (ib > 0)
+		if (ena_sel && selected(x, y))
+			new.mode ^= ATTR_REVERSE;
+		if (ib > 0 && ATTRCMP(base, new)) {
 			wldraws(buf, base, ox, y, ic, ib);
+			ic = ib = 0;
+		}
+		if (ib == 0) {
+			ox = x;
+			base = new;
+		}
+
+		buf[ib++] = new.u;
+		ic += (new.mode & ATTR_WIDE)? 2 : 1;
 	}
-	wldrawcursor();
+	if (ib > 0)
+		wldraws(buf, base, ox, y, ic, ib);
+}
+
+/*
+ * Whether a worker can draw line y: fonts, fontconfig, the fallback font
+ * cache and image uploads are not thread safe, so the line must only use
+ * glyphs of the regular, bold and italic fonts. Opening the variants and
+ * loading the glyphs here leaves nothing but reads for the workers.
+ */
+int
+drawsafe(int y)
+{
+	static const int flags[] = {
+		FRC_NORMAL, FRC_BOLD, FRC_ITALIC, FRC_ITALICBOLD
+	};
+	Glyph *gp = term->line[y];
+	Font *f;
+	int x;
+
+	for (x = 0; x < term->col; x++) {
+		if (gp[x].mode & ATTR_WDUMMY)
+			continue;
+		if (gp[x].mode & ATTR_IMAGE)
+			return 0;
+		f = wlloadvariant(flags[(gp[x].mode & ATTR_BOLD ? 1 : 0) |
+		                        (gp[x].mode & ATTR_ITALIC ? 2 : 0)]);
+		if (!wlisbox(gp[x].u) && !wlhaschar(f, gp[x].u))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Split the dirty lines a worker can draw into one band per thread, each
+ * drawn by its own renderer into the same buffer. The bands do not
+ * overlap, borders included, so there is nothing to lock while drawing.
+ * The other lines are left dirty for drawregion().
+ */
+void
+drawbands(int x1, int y1, int x2, int y2)
+{
+	static int *rows, nrows;
+	Painter *p;
+	int i, n, y, start;
+
+	/* only pay for the drawsafe() scan when the frame is worth splitting */
+	for (n = 0, y = y1; y < y2; y++)
+		n += term->dirty[y] != 0;
+	if (n < (npainters + 1) * DRAW_BAND_MIN)
+		return;
+
+	if (nrows < term->row)
+		rows = xrealloc(rows, (nrows = term->row) * sizeof(*rows));
+	for (n = 0, y = y1; y < y2; y++) {
+		if (term->dirty[y] && drawsafe(y))
+			rows[n++] = y;
+	}
+	if (n < (npainters + 1) * DRAW_BAND_MIN)
+		return;
+
+	pthread_mutex_lock(&drawlock);
+	for (i = 0; i < npainters; i++) {
+		p = &painters[i];
+		wld_set_target_buffer(p->renderer, win->buffer);
+		start = n * (i + 1) / (npainters + 1);
+		p->x1 = x1;
+		p->x2 = x2;
+		p->rows = &rows[start];
+		p->nrows = n * (i + 2) / (npainters + 1) - start;
+	}
+	drawbusy = npainters;
+	drawgen++;
+	pthread_cond_broadcast(&drawstart);
+	pthread_mutex_unlock(&drawlock);
+
+	/* the first band is ours */
+	for (i = 0; i < n / (npainters + 1); i++)
+		drawline(x1, x2, rows[i]);
+	dlsubmit();
+
+	pthread_mutex_lock(&drawlock);
+	while (drawbusy > 0)
+		pthread_cond_wait(&drawdone, &drawlock);
+	pthread_mutex_unlock(&drawlock);
+	for (i = 0; i < npainters; i++)
+		wld_flush(painters[i].renderer);
+}
+
+void *
+drawworker(void *arg)
+{
+	Painter *p = arg;
+	uint gen = 0;
+	int i;
+
+	painter = p;
+	pthread_mutex_lock(&drawlock);
+	for (;;) {
+		while (drawgen == gen)
+			pthread_cond_wait(&drawstart, &drawlock);
+		gen = drawgen;
+		pthread_mutex_unlock(&drawlock);
+
+		for (i = 0; i < p->nrows; i++)
+			drawline(p->x1, p->x2, p->rows[i]);
+		dlsubmit();
+
+		pthread_mutex_lock(&drawlock);
+		if (--drawbusy == 0)
+			pthread_cond_signal(&drawdone);
+	}
+	return NULL;
 }
 
 void
@@ -3886,62 +6644,176 @@ match(uint mask, uint state)
 void
 numlock(const Arg *dummy)
 {
-	term.numlock ^= 1;
+	term->numlock ^= 1;
 }
 
-char*
-kmap(xkb_keysym_t k, uint state)
+/*
+ * Claim (add != 0) or look up the hash slot of keysym k. The table is
+ * never full, keyinit() sizes it to at least twice the number of keysyms.
+ */
+Keyslot *
+keyslot(xkb_keysym_t k, int add)
 {
-	Key *kp;
-	int i;
+	uint i, mask = (1 << keytabbits) - 1;
+
+	if (k == XKB_KEY_NoSymbol)
+		return NULL;
 
-	/* Check for mapped keys out of X11 function keys. */
-	for (i = 0; i < LEN(mappedkeys); i++) {
-		if (mappedkeys[i] == k)
+	for (i = (k * 2654435761u) >> (32 - keytabbits); keytab[i].k != k;
+			i = (i + 1) & mask) {
+		if (keytab[i].k == XKB_KEY_NoSymbol) {
+			if (!add)
+				return NULL;
+			keytab[i].k = k;
 			break;
+		}
 	}
-	if (i == LEN(mappedkeys)) {
-		if ((k & 0xFFFF) < 0xFD00)
-			return NULL;
-	}
 
+	return &keytab[i];
+}
+
+/* Only X11 function keys and mappedkeys are looked up in key[]. */
+int
+keymapped(xkb_keysym_t k)
+{
+	int i;
+
+	for (i = 0; i < LEN(mappedkeys) && mappedkeys[i] != k; i++)
+		;
+	return i < LEN(mappedkeys) || (k & 0xFFFF) >= 0xFD00;
+}
+
+void
+keyinit(void)
+{
+	Shortcut *bp, **spool, **sp;
+	Key *kp, **kpool, **p;
+	Keyslot *ks;
+	int i, m, nslot;
+
+	for (keytabbits = 1; 1 << keytabbits < 2 * (LEN(shortcuts) + LEN(key));)
+		keytabbits++;
+	nslot = 1 << keytabbits;
+	keytab = xmalloc(nslot * sizeof(*keytab));
+	memset(keytab, 0, nslot * sizeof(*keytab));
+
+	/* zeroed pools: every list is implicitly NULL terminated */
+	spool = xmalloc((LEN(shortcuts) + nslot) * sizeof(*spool));
+	memset(spool, 0, (LEN(shortcuts) + nslot) * sizeof(*spool));
+	kpool = xmalloc(KM_NMODES * (LEN(key) + nslot) * sizeof(*kpool));
+	memset(kpool, 0, KM_NMODES * (LEN(key) + nslot) * sizeof(*kpool));
+
+	for (bp = shortcuts; bp < shortcuts + LEN(shortcuts); bp++)
+		keyslot(bp->keysym, 1);
 	for (kp = key; kp < key + LEN(key); kp++) {
-		if (kp->k != k)
-			continue;
+		if (keymapped(kp->k))
+			keyslot(kp->k, 1);
+	}
 
-		if (!match(kp->mask, state))
+	/*
+	 * Give every slot room for all entries of the tables, so the
+	 * lists can be filled in a single pass preserving their order.
+	 */
+	for (ks = keytab; ks < keytab + nslot; ks++) {
+		if (ks->k == XKB_KEY_NoSymbol)
 			continue;
+		ks->sc = spool;
+		for (bp = shortcuts; bp < shortcuts + LEN(shortcuts); bp++)
+			spool += bp->keysym == ks->k;
+		spool++;
+		for (i = 0, kp = key; kp < key + LEN(key); kp++)
+			i += kp->k == ks->k;
+		for (m = 0; m < KM_NMODES; m++) {
+			ks->key[m] = kpool;
+			kpool += i + 1;
+		}
+	}
 
-		if (IS_SET(MODE_APPKEYPAD) ? kp->appkey < 0 : kp->appkey > 0)
-			continue;
-		if (term.numlock && kp->appkey == 2)
+	for (bp = shortcuts; bp < shortcuts + LEN(shortcuts); bp++) {
+		for (sp = keyslot(bp->keysym, 0)->sc; *sp; sp++)
+			;
+		*sp = bp;
+	}
+	for (kp = key; kp < key + LEN(key); kp++) {
+		/* a shortcut may own the slot of a key that is not mapped */
+		if (!keymapped(kp->k) || !(ks = keyslot(kp->k, 0)))
 			continue;
+		for (m = 0; m < KM_NMODES; m++) {
+			if ((m & KM_APPKEYPAD) ? kp->appkey < 0 : kp->appkey > 0)
+				continue;
+			if ((m & KM_NUMLOCK) && kp->appkey == 2)
+				continue;
+			if ((m & KM_APPCURSOR) ? kp->appcursor < 0 : kp->appcursor > 0)
+				continue;
+			if ((m & KM_CRLF) ? kp->crlf < 0 : kp->crlf > 0)
+				continue;
+			for (p = ks->key[m]; *p; p++)
+				;
+			*p = kp;
+		}
+	}
+}
 
-		if (IS_SET(MODE_APPCURSOR) ? kp->appcursor < 0 : kp->appcursor > 0)
-			continue;
+int
+keymode(void)
+{
+	return (IS_SET(MODE_APPKEYPAD) ? KM_APPKEYPAD : 0)
+		| (term->numlock ? KM_NUMLOCK : 0)
+		| (IS_SET(MODE_APPCURSOR) ? KM_APPCURSOR : 0)
+		| (IS_SET(MODE_CRLF) ? KM_CRLF : 0);
+}
 
-		if (IS_SET(MODE_CRLF) ? kp->crlf < 0 : kp->crlf > 0)
-			continue;
+char *
+kmap(Keyslot *ks, uint state)
+{
+	Key **kp;
 
-		return kp->s;
+	for (kp = ks->key[keymode()]; *kp; kp++) {
+		if (match((*kp)->mask, state))
+			return (*kp)->s;
 	}
 
 	return NULL;
 }
 
+/*
+ * What ksym does with the modifiers in state: *sc is set to the shortcut
+ * it runs, or to NULL and the string key[] has it send is returned.
+ */
+char *
+keylookup(xkb_keysym_t ksym, uint state, Shortcut **sc)
+{
+	Shortcut **bp;
+	Keyslot *ks;
+
+	*sc = NULL;
+	if (!(ks = keyslot(ksym, 0)))
+		return NULL;
+	for (bp = ks->sc; *bp; bp++) {
+		if (match((*bp)->mod, state)) {
+			*sc = *bp;
+			return NULL;
+		}
+	}
+	return kmap(ks, state);
+}
+
+/* resize the loaded session's window and terminal */
 void
 cresize(int width, int height)
 {
 	int col, row;
 
 	if (width != 0)
-		wl.w = width;
+		win->w = width;
 	if (height != 0)
-		wl.h = height;
+		win->h = height;
 
-	col = (wl.w - 2 * borderpx) / wl.cw;
-	row = (wl.h - 2 * borderpx) / wl.ch;
+	col = (win->w - 2 * borderpx) / wl.cw;
+	row = (win->h - 2 * borderpx) / wl.ch;
 
+	/* the hints point into the screen being resized */
+	hintleave();
 	tresize(col, row);
 	wlresize(col, row);
 }
@@ -3956,6 +6828,11 @@ regglobal(void *data, struct wl_registry *registry, uint32_t name,
 	} else if (strcmp(interface, "xdg_wm_base") == 0) {
 		wl.wm = wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
 		xdg_wm_base_add_listener(wl.wm, &wmlistener, NULL);
+	} else if (strcmp(interface, "wp_presentation") == 0 && opt_trace) {
+		wl.presentation = wl_registry_bind(registry, name,
+				&wp_presentation_interface, 1);
+		wp_presentation_add_listener(wl.presentation, &preslistener,
+				NULL);
 	} else if (strcmp(interface, "wl_shm") == 0) {
 		wl.shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
 	} else if (strcmp(interface, "wl_seat") == 0) {
@@ -3978,26 +6855,34 @@ regglobalremove(void *data, struct wl_registry *registry, uint32_t name)
 void
 surfenter(void *data, struct wl_surface *surface, struct wl_output *output)
 {
-	wl.vis++;
-	if (!(wl.state & WIN_VISIBLE))
-		wl.state |= WIN_VISIBLE;
+	Window *w = data;
+
+	w->vis++;
+	if (!(w->state & WIN_VISIBLE)) {
+		w->state |= WIN_VISIBLE;
+		cursorblinkreset();
+	}
 }
 
 void
 surfleave(void *data, struct wl_surface *surface, struct wl_output *output)
 {
-	if (--wl.vis == 0)
-		wl.state &= ~WIN_VISIBLE;
+	Window *w = data;
+
+	if (--w->vis == 0) {
+		w->state &= ~WIN_VISIBLE;
+		cursorblinkreset();
+	}
 }
 
 void
 framedone(void *data, struct wl_callback *callback, uint32_t msecs)
 {
+	Window *w = data;
+
 	wl_callback_destroy(callback);
-	wl.framecb = NULL;
-	if (needdraw && wl.state & WIN_VISIBLE) {
-		draw();
-	}
+	w->framecb = NULL;
+	windraw(w);
 }
 
 void
@@ -4036,26 +6921,42 @@ void
 kbdenter(void *data, struct wl_keyboard *keyboard, uint32_t serial,
          struct wl_surface *surface, struct wl_array *keys)
 {
-	wl.state |= WIN_FOCUSED;
+	Window *w;
+
+	if (!surface)
+		return;
+	w = wl_surface_get_user_data(surface);
+	wl.serial = serial;
+	w->state |= WIN_FOCUSED;
+	/* input goes to the session the window shows */
+	if (w->shown != active)
+		sessionswitch(w->shown);
 	if (IS_SET(MODE_FOCUS))
 		ttywrite("\033[I", 3);
 	/* need to redraw the cursor */
-	needdraw = true;
+	cursorblinkreset();
+	win->needdraw = true;
 }
 
 void
 kbdleave(void *data, struct wl_keyboard *keyboard, uint32_t serial,
 	 struct wl_surface *surface)
 {
+	Window *w;
+
 	/* selection offers are invalidated when we lose keyboard focus */
 	wl.seloffer = NULL;
-	wl.state &= ~WIN_FOCUSED;
+	/* NULL when the window was closed */
+	if (surface && (w = wl_surface_get_user_data(surface)))
+		w->state &= ~WIN_FOCUSED;
 	if (IS_SET(MODE_FOCUS))
 		ttywrite("\033[O", 3);
 	/* need to redraw the cursor */
-	needdraw = true;
+	cursorblinkreset();
+	win->needdraw = true;
 	/* disable key repeat */
 	repeat.len = 0;
+	timerstop(&repeattimer);
 }
 
 void
@@ -4067,34 +6968,44 @@ kbdkey(void *data, struct wl_keyboard *keyboard, uint32_t serial, uint32_t time,
 	int len;
 	Rune c;
 	Shortcut *bp;
+	struct timespec now;
 
+	wl.serial = serial;
 	if (IS_SET(MODE_KBDLOCK))
 		return;
 
 	if (state == WL_KEYBOARD_KEY_STATE_RELEASED) {
-		if (repeat.key == key)
+		if (repeat.key == key) {
 			repeat.len = 0;
+			timerstop(&repeattimer);
+		}
 		return;
 	}
 
+	/* kept with -S if the key turns out to do something */
+	if (opt_trace)
+		clock_gettime(latclock, &now);
+	cursorblinkreset();
 	ksym = xkb_state_key_get_one_sym(wl.xkb.state, key + 8);
+	if (active->hints.active) {
+		hintkey(ksym, serial);
+		return;
+	}
 	len = xkb_keysym_to_utf8(ksym, buf, sizeof buf);
 	if (len > 0)
 	    --len;
 
-	/* 1. shortcuts */
-	for (bp = shortcuts; bp < shortcuts + LEN(shortcuts); bp++) {
-		if (ksym == bp->keysym && match(bp->mod, wl.xkb.mods)) {
-			bp->func(&(bp->arg));
-			return;
-		}
-	}
-
-	/* 2. custom keys from config.h */
-	if ((str = kmap(ksym, wl.xkb.mods))) {
+	/* 1. shortcuts, 2. custom keys from config.h */
+	if ((str = keylookup(ksym, wl.xkb.mods, &bp))) {
 		len = strlen(str);
 		goto send;
 	}
+	if (bp) {
+		if (opt_trace)
+			latkey(&now);
+		bp->func(&bp->arg);
+		return;
+	}
 
 	/* 3. composed string from input method */
 	if (len == 0)
@@ -4125,11 +7036,12 @@ kbdkey(void *data, struct wl_keyboard *keyboard, uint32_t serial, uint32_t time,
 	str = buf;
 
 send:
+	if (opt_trace)
+		latkey(&now);
 	memcpy(repeat.str, str, len);
 	repeat.key = key;
 	repeat.len = len;
-	repeat.started = false;
-	clock_gettime(CLOCK_MONOTONIC, &repeat.last);
+	timerset(&repeattimer, keyrepeatdelay);
 	ttysend(str, len);
 }
 
@@ -4169,6 +7081,9 @@ ptrenter(void *data, struct wl_pointer *pointer, uint32_t serial,
 	struct wl_cursor_image *img = cursor.cursor->images[0];
 	struct wl_buffer *buffer;
 
+	wl.pointed = wl_surface_get_user_data(surface);
+	wl.px = wl_fixed_to_int(x);
+	wl.py = wl_fixed_to_int(y);
 	wl_pointer_set_cursor(pointer, serial, cursor.surface,
 			img->hotspot_x, img->hotspot_y);
 	buffer = wl_cursor_image_get_buffer(img);
@@ -4181,6 +7096,7 @@ void
 ptrleave(void *data, struct wl_pointer *pointer, uint32_t serial,
          struct wl_surface *surface)
 {
+	wl.pointed = NULL;
 }
 
 void
@@ -4189,6 +7105,12 @@ ptrmotion(void *data, struct wl_pointer * pointer, uint32_t serial,
 {
 	int oldey, oldex, oldsby, oldsey;
 
+	/* a click makes another window's session active, see ptrbutton() */
+	if (wl.pointed != active->win) {
+		wl.px = wl_fixed_to_int(x);
+		wl.py = wl_fixed_to_int(y);
+		return;
+	}
 	if (IS_SET(MODE_MOUSE)) {
 		wlmousereportmotion(x, y);
 		return;
@@ -4217,6 +7139,11 @@ ptrbutton(void * data, struct wl_pointer * pointer, uint32_t serial,
 {
 	MouseShortcut *ms;
 
+	if (!wl.pointed)
+		return;
+	if (wl.pointed->shown != active)
+		sessionswitch(wl.pointed->shown);
+	wl.serial = serial;
 	if (IS_SET(MODE_MOUSE) && !(wl.xkb.mods & forceselmod)) {
 		wlmousereportbutton(button, state);
 		return;
@@ -4283,6 +7210,8 @@ ptraxis(void * data, struct wl_pointer * pointer, uint32_t time, uint32_t axis,
 	Axiskey *ak;
 	int dir = value > 0 ? +1 : -1;
 
+	if (wl.pointed != active->win)
+		return;
 	if (IS_SET(MODE_MOUSE) && !(wl.xkb.mods & forceselmod)) {
 		wlmousereportaxis(axis, value);
 		return;
@@ -4307,27 +7236,42 @@ void
 xdgsurfconfigure(void *data, struct xdg_surface *surf, uint32_t serial)
 {
 	xdg_surface_ack_configure(surf, serial);
+	startstep(STEP_CONFIGURE);
 }
 
 void
-toplevelconfigure(void *data, struct xdg_toplevel *toplevel, int32_t w, int32_t h,
-                  struct wl_array *states)
+toplevelconfigure(void *data, struct xdg_toplevel *toplevel, int32_t width,
+                  int32_t height, struct wl_array *states)
 {
-	if (w == wl.w && h == wl.h)
+	Window *w = data;
+
+	/* the first configure makes the buffer */
+	if (w->configured && width == w->w && height == w->h)
 		return;
-	cresize(w, h);
-	if (wl.configured)
+	sessionload(w->shown);
+	cresize(width, height);
+	/* run() starts the first shell once the size is known */
+	if (w->configured || loaded->pid)
 		ttyresize();
-	else
-		wl.configured = true;
+	w->configured = true;
+	if (active)
+		sessionload(active);
 }
 
 void
 toplevelclose(void *data, struct xdg_toplevel *toplevel)
 {
-	/* Send SIGHUP to shell */
-	kill(pid, SIGHUP);
-	exit(0);
+	Window *w = data;
+	int i;
+
+	/* Send SIGHUP to the shells of the window */
+	for (i = 0; i < nsessions; i++) {
+		if (sessions[i]->win == w)
+			kill(sessions[i]->pid, SIGHUP);
+	}
+	winclose(w);
+	if (active->win == w)
+		sessionswitch(windows[0]->shown);
 }
 
 void
@@ -4407,121 +7351,788 @@ datasrccancelled(void *data, struct wl_data_source *source)
 	wl_data_source_destroy(source);
 }
 
+int
+timerbefore(Timer *a, Timer *b)
+{
+	return a->when.tv_sec < b->when.tv_sec ||
+	       (a->when.tv_sec == b->when.tv_sec &&
+	        a->when.tv_nsec < b->when.tv_nsec);
+}
+
+void
+timerplace(Timer *t, int i)
+{
+	timers[i] = t;
+	t->idx = i + 1;
+}
+
+void
+timersift(int i)
+{
+	Timer *t = timers[i];
+	int c;
+
+	for (; i > 0 && timerbefore(t, timers[(i-1)/2]); i = (i-1)/2)
+		timerplace(timers[(i-1)/2], i);
+	for (; (c = 2*i + 1) < ntimers; i = c) {
+		if (c + 1 < ntimers && timerbefore(timers[c+1], timers[c]))
+			c++;
+		if (!timerbefore(timers[c], t))
+			break;
+		timerplace(timers[c], i);
+	}
+	timerplace(t, i);
+}
+
+void
+timerset(Timer *t, long msecs)
+{
+	clock_gettime(CLOCK_MONOTONIC, &t->when);
+	t->when.tv_sec += msecs / 1000;
+	t->when.tv_nsec += (msecs % 1000) * 1000000;
+	if (t->when.tv_nsec >= 1000000000) {
+		t->when.tv_sec++;
+		t->when.tv_nsec -= 1000000000;
+	}
+
+	if (!t->idx) {
+		if (ntimers == LEN(timers))
+			die("too many timers\n");
+		timerplace(t, ntimers++);
+	}
+	timersift(t->idx - 1);
+}
+
+void
+timerstop(Timer *t)
+{
+	int i = t->idx - 1;
+
+	if (!t->idx)
+		return;
+	t->idx = 0;
+	if (i == --ntimers)
+		return;
+	timers[i] = timers[ntimers];
+	timersift(i);
+}
+
+/* milliseconds until the earliest timer expires, -1 if none is armed */
+int
+timernext(void)
+{
+	struct timespec now;
+	long msecs;
+
+	if (!ntimers)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	msecs = (timers[0]->when.tv_sec - now.tv_sec) * 1000 +
+	        (timers[0]->when.tv_nsec - now.tv_nsec + 999999) / 1000000;
+	return MAX(msecs, 0);
+}
+
+void
+timerrun(void)
+{
+	struct timespec now;
+	Timer *t;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while (ntimers) {
+		t = timers[0];
+		if (now.tv_sec < t->when.tv_sec ||
+		    (now.tv_sec == t->when.tv_sec &&
+		     now.tv_nsec < t->when.tv_nsec))
+			break;
+		timerstop(t);
+		t->fn(t);
+	}
+}
+
+void
+blinktick(Timer *t)
+{
+	int x, y, set = 0;
+
+	/* only lines flagged by tsetchar can hold blinking glyphs */
+	for (y = 0; y < term->row; y++) {
+		if (!term->blink[y])
+			continue;
+		for (x = 0; x < term->col; x++) {
+			if (term->line[y][x].mode & ATTR_BLINK)
+				break;
+		}
+		if (x == term->col) {
+			term->blink[y] = 0;
+		} else {
+			tsetdirt(y, y);
+			set = 1;
+		}
+	}
+	if (!set) {
+		MODBIT(term->mode, 0, MODE_BLINK);
+		return;
+	}
+	term->mode ^= MODE_BLINK;
+	timerset(t, blinktimeout);
+}
+
+void
+repeattick(Timer *t)
+{
+	if (repeat.len <= 0)
+		return;
+	ttysend(repeat.str, repeat.len);
+	timerset(t, keyrepeatinterval);
+}
+
+/*
+ * Show the cursor and start its blinking over, if it blinks and can be
+ * seen; otherwise leave the timer off so nothing wakes us up. Only the
+ * active session's cursor blinks, sessionswitch() resets it.
+ */
+void
+cursorblinkreset(void)
+{
+	Term *t;
+
+	if (loaded != active)
+		return;
+	t = &active->term;
+	if (t->cursoroff) {
+		t->cursoroff = 0;
+		win->needdraw = true;
+	}
+	if (cursorblinktimeout && (t->cursor == 0 || t->cursor % 2) &&
+	    t->cursor < 7 && !(t->mode & MODE_HIDE) &&
+	    (win->state & (WIN_FOCUSED|WIN_VISIBLE)) ==
+	    (WIN_FOCUSED|WIN_VISIBLE)) {
+		timerset(&cursorblinktimer, cursorblinktimeout);
+	} else {
+		timerstop(&cursorblinktimer);
+	}
+}
+
+/* with no dirty line, draw() only repaints the cursor cell */
+void
+cursorblinktick(Timer *t)
+{
+	active->term.cursoroff = !active->term.cursoroff;
+	win->needdraw = true;
+	timerset(t, cursorblinktimeout);
+}
+
+void
+synctick(Timer *t)
+{
+	/* the application never ended its update, show what we have */
+	MODBIT(term->mode, 0, MODE_SYNC);
+}
+
+void
+watchadd(Watch *w, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = w };
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, w->fd, &ev) < 0)
+		die("epoll_ctl failed: %s\n", strerror(errno));
+}
+
+void
+watchdel(Watch *w)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, NULL);
+}
+
+void
+ttyready(Watch *w, uint32_t events)
+{
+	/* edge triggered: read until EAGAIN before expecting another event */
+	((Session *)w)->pending = 1;
+}
+
+void
+wlready(Watch *w, uint32_t events)
+{
+	if (wl_display_dispatch(wl.dpy) == -1)
+		die("Connection error\n");
+}
+
+void
+sigready(Watch *w, uint32_t events)
+{
+	struct signalfd_siginfo si;
+
+	while (read(w->fd, &si, sizeof si) == sizeof si) {
+		if (si.ssi_signo == SIGCHLD)
+			sigchld(SIGCHLD);
+		else if (si.ssi_signo == SIGUSR1)
+			tracereport();
+	}
+}
+
 void
 run(void)
 {
-	fd_set rfd;
-	int wlfd = wl_display_get_fd(wl.dpy), blinkset = 0;
-	struct timespec drawtimeout, *tv = NULL, now, last, lastblink;
-	ulong msecs;
+	struct epoll_event ev[8];
+	sigset_t set;
+	int i, j, n, msecs, pending;
+	bool dirty;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		die("epoll_create1 failed: %s\n", strerror(errno));
+
+	/* block SIGCHLD before forking so that no exit is missed */
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	if (opt_trace) /* for the -S report on demand */
+		sigaddset(&set, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	if ((sigwatch.fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+		die("signalfd failed: %s\n", strerror(errno));
+	watchadd(&sigwatch, EPOLLIN);
+
+	wlwatch.fd = wl_display_get_fd(wl.dpy);
+	watchadd(&wlwatch, EPOLLIN);
+
+	if (daemonwatch.fd >= 0)
+		watchadd(&daemonwatch, EPOLLIN);
 
 	/* Look for initial configure. */
 	wl_display_roundtrip(wl.dpy);
-	if (!wl.configured)
-		cresize(wl.w, wl.h);
-	ttynew();
-	ttyresize();
+	if (!win->configured) {
+		cresize(win->w, win->h);
+		win->configured = true;
+	}
+	/* the first session's terminal was made by main() */
+	sessionswitch(sessionstart(loaded));
 	draw();
 
-	clock_gettime(CLOCK_MONOTONIC, &last);
-	lastblink = last;
-
 	for (;;) {
-		FD_ZERO(&rfd);
-		FD_SET(cmdfd, &rfd);
-		FD_SET(wlfd, &rfd);
-
-		if (pselect(MAX(wlfd, cmdfd)+1, &rfd, NULL, NULL, tv, NULL) < 0) {
+		/* leftover pty input must not wait for another event */
+		for (i = 0, pending = 0; i < nsessions; i++)
+			pending |= sessions[i]->pending;
+		msecs = pending ? 0 : timernext();
+		if ((n = epoll_wait(epfd, ev, LEN(ev), msecs)) < 0) {
 			if (errno == EINTR)
 				continue;
-			die("select failed: %s\n", strerror(errno));
+			die("epoll_wait failed: %s\n", strerror(errno));
+		}
+
+		for (i = 0; i < n; i++)
+			((Watch *)ev[i].data.ptr)->fn(ev[i].data.ptr,
+			                              ev[i].events);
+		for (i = 0; i < nsessions; i++) {
+			if (sessions[i]->dead)
+				sessionclose(sessions[i--]);
 		}
 
-		if (FD_ISSET(cmdfd, &rfd)) {
+		/*
+		 * Bound the draining so that a flood of output still lets
+		 * input, timers and frames through between batches.
+		 */
+		for (i = 0; active->pending && i < ttyreadbatch; i++)
 			ttyread();
-			if (blinktimeout) {
-				blinkset = tattrset(ATTR_BLINK);
-				if (!blinkset)
-					MODBIT(term.mode, 0, MODE_BLINK);
-			}
+
+		/* output of the sessions in background tabs is not drawn */
+		for (j = 0; j < nsessions; j++) {
+			if (sessions[j] == active || !sessions[j]->pending)
+				continue;
+			sessionload(sessions[j]);
+			dirty = win->needdraw;
+			for (i = 0; loaded->pending && i < ttyreadbatch; i++)
+				ttyread();
+			if (loaded != win->shown)
+				win->needdraw = dirty;
 		}
+		sessionload(active);
+
+		timerrun();
+
+		for (i = 0; i < nwindows; i++)
+			windraw(windows[i]);
+
+		wl_display_dispatch_pending(wl.dpy);
+		wl_display_flush(wl.dpy);
+	}
+}
+
+void
+presclockid(void *data, struct wp_presentation *presentation, uint32_t clk)
+{
+	/* the key times are taken on the clock of the presentation times */
+	latclock = clk;
+}
+
+void
+presfbsync(void *data, struct wp_presentation_feedback *fb,
+           struct wl_output *output)
+{
+}
+
+void
+presfbpresented(void *data, struct wp_presentation_feedback *fb,
+                uint32_t sechi, uint32_t seclo, uint32_t nsec,
+                uint32_t refresh, uint32_t seqhi, uint32_t seqlo,
+                uint32_t flags)
+{
+	struct timespec *key = data, t;
+
+	t.tv_sec = (time_t)((uint64_t)sechi << 32 | seclo);
+	t.tv_nsec = nsec;
+	latsample(LAT_PRESENT, key, &t);
+	free(key);
+	wp_presentation_feedback_destroy(fb);
+}
+
+void
+presfbdiscarded(void *data, struct wp_presentation_feedback *fb)
+{
+	latdiscarded++;
+	free(data);
+	wp_presentation_feedback_destroy(fb);
+}
+
+/* starts following a key press that was sent or ran a shortcut */
+void
+latkey(struct timespec *t)
+{
+	memset(&keylat, 0, sizeof(keylat));
+	keylat.key = *t;
+	timerset(&lattimer, LAT_TIMEOUT);
+}
+
+void
+lattick(Timer *t)
+{
+	/* no echo, or nothing to draw: not a sample of anything */
+	memset(&keylat, 0, sizeof(keylat));
+	latdropped++;
+}
+
+int
+latset(struct timespec *t)
+{
+	return t->tv_sec || t->tv_nsec;
+}
+
+/* marks a stage of the key press on its way, the first time only */
+void
+latstamp(int stage)
+{
+	if (latset(&keylat.key) && !latset(&keylat.t[stage]))
+		clock_gettime(latclock, &keylat.t[stage]);
+}
+
+void
+latsample(int stage, struct timespec *from, struct timespec *to)
+{
+	long long us = (to->tv_sec - from->tv_sec) * 1000000LL +
+	               (to->tv_nsec - from->tv_nsec) / 1000;
+
+	latus[stage][latn[stage]++ % LAT_SAMPLES] = MAX(us, 0);
+}
+
+int
+latcmp(const void *a, const void *b)
+{
+	uint x = *(const uint *)a, y = *(const uint *)b;
 
-		if (FD_ISSET(wlfd, &rfd)) {
-			if (wl_display_dispatch(wl.dpy) == -1)
-				die("Connection error\n");
+	return (x > y) - (x < y);
+}
+
+/*
+ * The -S totals to stderr: frames and their renderer calls, and the
+ * percentiles of the latest key presses at each stage.
+ */
+void
+tracereport(void)
+{
+	static const char *name[] = {
+		[LAT_SEND]    = "send",
+		[LAT_ECHO]    = "echo",
+		[LAT_COMMIT]  = "commit",
+		[LAT_PRESENT] = "present",
+	};
+	static uint s[LAT_SAMPLES];
+	int i, n;
+
+	if (traceframes)
+		fprintf(stderr, "st: %ld frames, %ld renderer calls for %ld"
+		        " operations\n", traceframes, tracecalls, traceops);
+	for (i = 0; i < LAT_LAST; i++) {
+		if (!(n = MIN(latn[i], LAT_SAMPLES)))
+			continue;
+		memcpy(s, latus[i], n * sizeof(*s));
+		qsort(s, n, sizeof(*s), latcmp);
+		fprintf(stderr, "st: key to %-7s %5d keys, p50 %.3f p90 %.3f"
+		        " p99 %.3f max %.3f ms\n", name[i], n, s[n / 2] / 1e3,
+		        s[n * 9 / 10] / 1e3, s[n * 99 / 100] / 1e3,
+		        s[n - 1] / 1e3);
+	}
+	if (latdiscarded)
+		fprintf(stderr, "st: %d key frames were not presented\n",
+		        latdiscarded);
+	if (latdropped)
+		fprintf(stderr, "st: %d keys showed nothing within %d ms\n",
+		        latdropped, LAT_TIMEOUT);
+}
+
+void
+usage(void)
+{
+	die("usage: %s [-aBdiSv] [-c class] [-f font] [-g geometry]"
+	    " [-n name] [-o file]\n"
+	    "          [-r file] [-T title] [-t title] [-w windowid]"
+	    " [[-e] command [args ...]]\n"
+	    "       %s [-aiSv] [-c class] [-f font] [-g geometry]"
+	    " [-n name] [-o file]\n"
+	    "          [-T title] [-t title] [-w windowid] {-p | -P} file\n"
+	    "       %s [-aiv] [-c class] [-f font] [-g geometry]"
+	    " [-n name] [-o file]\n"
+	    "          [-r file] [-T title] [-t title] [-w windowid] -l line"
+	    " [stty_args ...]\n", argv0, argv0, argv0);
+}
+
+void
+startstep(int step)
+{
+	static const char *name[] = {
+		[STEP_DISPLAY]   = "display connected",
+		[STEP_FONT]      = "font loaded",
+		[STEP_WINDOW]    = "window created",
+		[STEP_CONFIGURE] = "first configure",
+		[STEP_DRAW]      = "first draw",
+		[STEP_IFONT]     = "italic font loaded",
+		[STEP_BFONT]     = "bold font loaded",
+		[STEP_IBFONT]    = "bold italic font loaded",
+	};
+	static uint done;
+	struct timespec now;
+
+	if (!opt_trace || done & 1 << step)
+		return;
+	done |= 1 << step;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(stderr, "st: %8.3f ms %s\n",
+	        (now.tv_sec - starttime.tv_sec) * 1e3 +
+	        (now.tv_nsec - starttime.tv_nsec) / 1e6, name[step]);
+}
+
+/*
+ * Draws canned screens into a buffer of wld's software renderer, with
+ * no display, and prints what full and single line redraws cost.
+ */
+void
+bench(void)
+{
+	static const char *name[] = {
+		"text", "256color", "truecolor", "cjk", "box", "frame",
+	};
+	struct timespec a, b, c;
+	int i, k, fcalls, fops, lcalls, lops;
+
+	if (!FcInit())
+		die("Could not init fontconfig.\n");
+	wld.ctx = wld_pixman_context;
+	painterinit();
+	usedfont = (opt_font == NULL)? font : opt_font;
+	wld.fontctx = wld_font_create_context();
+	wlloadfonts(usedfont, 0);
+	wlloadcols();
+	/* a window without a surface */
+	win = xmalloc(sizeof(*win));
+	memset(win, 0, sizeof(*win));
+	win->shown = sessionnew(win, MAX(cols, 1), MAX(rows, 1));
+	win->state = WIN_VISIBLE | WIN_FOCUSED;
+	win->h = 2 * borderpx + term->row * wl.ch;
+	win->w = 2 * borderpx + term->col * wl.cw;
+	win->tw = term->col * wl.cw;
+	win->th = term->row * wl.ch;
+	if (!(win->buffer = wld_create_buffer(wld.ctx, win->w, win->h,
+	                                     WLD_FORMAT_XRGB8888, 0)))
+		die("Could not create buffer\n");
+	wld_set_target_buffer(wld.renderer, win->buffer);
+
+	printf("%dx%d cells of %dx%d, %d runs each\n", term->col, term->row,
+	       wl.cw, wl.ch, BENCH_RUNS);
+	for (k = 0; k < LEN(name); k++) {
+		benchfill(k);
+		/* the first draw loads glyphs and fills caches */
+		tfulldirt();
+		drawregion(0, 0, term->col, term->row);
+		wld_flush(wld.renderer);
+		drawstats(&fops);
+
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		for (i = 0; i < BENCH_RUNS; i++) {
+			tfulldirt();
+			drawregion(0, 0, term->col, term->row);
+			wld_flush(wld.renderer);
 		}
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		fcalls = drawstats(&fops);
+		for (i = 0; i < BENCH_RUNS; i++) {
+			term->dirty[term->row / 2] = 1;
+			drawregion(0, 0, term->col, term->row);
+			wld_flush(wld.renderer);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &c);
+		lcalls = drawstats(&lops);
+
+		printf("%-10s full %8.3f ms %5d calls %5d ops"
+		       "   line %7.3f ms %4d calls %4d ops\n", name[k],
+		       ((b.tv_sec - a.tv_sec) * 1e3 +
+		        (b.tv_nsec - a.tv_nsec) / 1e6) / BENCH_RUNS,
+		       fcalls / BENCH_RUNS, fops / BENCH_RUNS,
+		       ((c.tv_sec - b.tv_sec) * 1e3 +
+		        (c.tv_nsec - b.tv_nsec) / 1e6) / BENCH_RUNS,
+		       lcalls / BENCH_RUNS, lops / BENCH_RUNS);
+	}
+	benchparse();
+	benchsixel();
+	benchkeys();
+}
 
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		msecs = -1;
+/* writes screen k of bench() through the parser */
+void
+benchfill(int k)
+{
+	char buf[64];
+	int x, y, n;
+	Rune u;
 
-		if (blinkset && blinktimeout) {
-			if (TIMEDIFF(now, lastblink) >= blinktimeout) {
-				tsetdirtattr(ATTR_BLINK);
-				term.mode ^= MODE_BLINK;
-				lastblink = now;
-			} else {
-				msecs = MIN(msecs, blinktimeout - \
-						TIMEDIFF(now, lastblink));
+	twrite("\033[0m\033[H\033[2J", 11);
+	for (y = 0; y < term->row; y++) {
+		for (x = 0; x < term->col; x++) {
+			n = 0;
+			switch (k) {
+			case 0: /* text */
+				buf[n++] = (x + y) % 7 ? 'a' + (x + y * 3) % 26 : ' ';
+				break;
+			case 1: /* 256color */
+				n = snprintf(buf, sizeof(buf),
+				             "\033[38;5;%d;48;5;%dm%c",
+				             (x + y) % 256, (x * 3 + y * 5) % 256,
+				             'A' + (x + y) % 26);
+				break;
+			case 2: /* truecolor */
+				n = snprintf(buf, sizeof(buf),
+				             "\033[38;2;%d;%d;%d;48;2;%d;%d;%dm%c",
+				             255 - x * 255 / term->col, y * 255 / term->row,
+				             128, x * 255 / term->col, 64,
+				             y * 255 / term->row, 'a' + (x + y) % 26);
+				break;
+			case 3: /* cjk */
+				if (x == term->col - 1)
+					break;
+				u = 0x4E00 + (x * 31 + y * 17) % 0x800;
+				n = utf8encode(u, buf);
+				x++;
+				break;
+			case 4: /* box */
+				u = 0x2500 + (x + y * 7) % LEN(boxes);
+				n = utf8encode(u, buf);
+				break;
+			case 5: /* frame: panes split by lines, text inside */
+				if (y == 0 || y == term->row - 1)
+					u = x % 20 ? 0x2500 : y ? 0x2534 : 0x252C;
+				else if (x % 20 == 0 || x == term->col - 1)
+					u = 0x2502;
+				else
+					u = (x + y) % 7 ? 'a' + (x + y * 3) % 26 : ' ';
+				n = utf8encode(u, buf);
+				break;
 			}
+			twrite(buf, n);
 		}
-		if (repeat.len > 0) {
-			if (TIMEDIFF(now, repeat.last) >= \
-				(repeat.started ? keyrepeatinterval : \
-					keyrepeatdelay)) {
-				repeat.started = true;
-				repeat.last = now;
-				ttysend(repeat.str, repeat.len);
-			} else {
-				msecs = MIN(msecs, (repeat.started ? \
-					keyrepeatinterval : keyrepeatdelay) - \
-					TIMEDIFF(now, repeat.last));
+		if (y < term->row - 1)
+			twrite("\r\n", 2);
+	}
+	twrite("\033[0m", 4);
+}
+
+/*
+ * Time the parser alone on canned streams fed to twrite() in reads of
+ * BUFSIZ like ttyread() does: coloured full screen redraws as vim does
+ * them, scroll region and status line updates as tmux does them, plain
+ * ASCII lines and mixed UTF-8 lines. The best of five runs counts.
+ */
+void
+benchparse(void)
+{
+	static const char *name[] = { "vim", "tmux", "text", "utf8" };
+	struct timespec a, b;
+	char *buf;
+	size_t n, off;
+	double t, best;
+	int i, k, x, y, r;
+
+	buf = xmalloc(BENCH_STREAM + BUFSIZ * 4);
+	for (k = 0; k < LEN(name); k++) {
+		for (n = 0, i = 0; n < BENCH_STREAM; i++) {
+			switch (k) {
+			case 0:
+				for (y = 1; y <= term->row; y++) {
+					n += sprintf(buf + n, "\033[%d;1H\033[38;5;"
+					             "%dm%4d \033[0m", y, 130 + y % 8,
+					             i + y);
+					for (x = 0; x < (term->col - 5) / 8; x++) {
+						n += sprintf(buf + n, "\033[%d;%dm"
+						             "token%02d \033[m",
+						             30 + (x + y) % 8,
+						             x % 2 ? 1 : 22, x);
+					}
+					n += sprintf(buf + n, "\033[K");
+				}
+				break;
+			case 1:
+				n += sprintf(buf + n, "\033[2;%dr\033[%d;1H\n"
+				             "\033[1;31mlog line %d\033[m\033[r"
+				             "\033[%d;%dH\033[2K\033[7m status %d "
+				             "\033[27m\033[?25l\033[?25h",
+				             term->row - 1, term->row - 1, i,
+				             1 + i % term->row, 1 + i % term->col, i);
+				break;
+			case 2:
+				n += sprintf(buf + n, "The quick brown fox jumps "
+				             "over the lazy dog; 0123456789\r\n");
+				break;
+			case 3:
+				n += sprintf(buf + n, "Größenwahn — 日本語のテキスト "
+				             "ελληνικά ✓ ☃ résumé naïve\r\n");
+				break;
 			}
 		}
 
-		if (needdraw && wl.state & WIN_VISIBLE) {
-			if (!wl.framecb) {
-				draw();
+		for (r = 0, best = 1e9; r < 5; r++) {
+			treset();
+			clock_gettime(CLOCK_MONOTONIC, &a);
+			for (off = 0; off < n; off += i) {
+				if (!(i = twrite(buf + off, MIN(BUFSIZ, n - off))))
+					break;
 			}
+			clock_gettime(CLOCK_MONOTONIC, &b);
+			t = (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+			best = MIN(best, t);
 		}
+		printf("parse %-4s %8.1f MB/s\n", name[k], n / best / 1e6);
+	}
+	free(buf);
+}
 
-		if (msecs == -1) {
-			tv = NULL;
-		} else {
-			drawtimeout.tv_nsec = 1E6 * msecs;
-			drawtimeout.tv_sec = 0;
-			tv = &drawtimeout;
+/*
+ * Time decoding and placing a sixel animation: frames as large as the
+ * screen, each drawn at the home position in 16 colours changing between
+ * frames, fed in reads of BUFSIZ. The best of five runs counts.
+ */
+void
+benchsixel(void)
+{
+	struct timespec a, b;
+	char *buf;
+	size_t n, off, fsiz;
+	double t, best;
+	int w = term->col * wl.cw, h = (term->row - 1) * wl.ch / 6 * 6;
+	int i, c, x, band, f, r;
+
+	/* the most one frame takes: header, palette and 4 runs per band */
+	fsiz = 64 + 16 * 32 + h / 6 * (4 * (8 + (w / 16 + 1) * 12) + 1);
+	buf = xmalloc(BENCH_STREAM + fsiz);
+	for (n = 0, f = 0; n < BENCH_STREAM; f++) {
+		n += sprintf(buf + n, "\033[H\033Pq\"1;1;%d;%d", w, h);
+		for (i = 0; i < 16; i++) {
+			n += sprintf(buf + n, "#%d;2;%d;%d;%d", i, i * 6,
+			             f * 3 % 100, 100 - i * 6);
+		}
+		for (band = 0; band < h / 6; band++) {
+			for (i = 0; i < 4; i++) {
+				c = (band + f + i) % 16;
+				n += sprintf(buf + n, "#%d", c);
+				for (x = 0; x < w; x += 16) {
+					n += sprintf(buf + n, "%c!7%c%c!7%c",
+					             '?' + ((x + band + i) & 63),
+					             '?' + (1 << i | 32), '~' - i,
+					             '?' + (x & 63));
+				}
+				n += sprintf(buf + n, "$");
+			}
+			n += sprintf(buf + n, "-");
 		}
+		n += sprintf(buf + n, "\033\\");
+	}
 
-		wl_display_dispatch_pending(wl.dpy);
-		wl_display_flush(wl.dpy);
+	for (r = 0, best = 1e9; r < 5; r++) {
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		for (off = 0; off < n; off += i) {
+			if (!(i = twrite(buf + off, MIN(BUFSIZ, n - off))))
+				break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		t = (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+		best = MIN(best, t);
 	}
+	printf("%-10s %8.1f MB/s, %.0f frames/s of %dx%d\n", "sixel",
+	       n / best / 1e6, f / best, w, h);
+	free(buf);
 }
 
+/*
+ * Time what a key press looks up before anything is sent: the keysyms of
+ * shortcuts[] and key[] and the letters, which are in neither, with each
+ * combination of modifiers.
+ */
 void
-usage(void)
-{
-	die("usage: %s [-aiv] [-c class] [-f font] [-g geometry]"
-	    " [-n name] [-o file]\n"
-	    "          [-T title] [-t title] [-w windowid]"
-	    " [[-e] command [args ...]]\n"
-	    "       %s [-aiv] [-c class] [-f font] [-g geometry]"
-	    " [-n name] [-o file]\n"
-	    "          [-T title] [-t title] [-w windowid] -l line"
-	    " [stty_args ...]\n", argv0, argv0);
+benchkeys(void)
+{
+	xkb_keysym_t *ks;
+	struct timespec a, b;
+	Shortcut *sc;
+	int i, j, m, n = 0, found = 0;
+
+	keyinit();
+	ks = xmalloc((LEN(shortcuts) + LEN(key) + 26) * sizeof(*ks));
+	for (i = 0; i < LEN(shortcuts); i++)
+		ks[n++] = shortcuts[i].keysym;
+	for (i = 0; i < LEN(key); i++)
+		ks[n++] = key[i].k;
+	for (i = 0; i < 26; i++)
+		ks[n++] = XKB_KEY_a + i;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	for (i = 0; i < BENCH_RUNS * 100; i++) {
+		for (j = 0; j < n; j++) {
+			for (m = 0; m < 16; m++)
+				found += keylookup(ks[j], m, &sc) || sc;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	printf("%-10s %8.1f ns per lookup, %d keysyms, %d of %d found\n",
+	       "keys", ((b.tv_sec - a.tv_sec) * 1e9 +
+	        (b.tv_nsec - a.tv_nsec)) / (BENCH_RUNS * 100 * n * 16),
+	       n, found / (BENCH_RUNS * 100), n * 16);
+	free(ks);
 }
 
 int
 main(int argc, char *argv[])
 {
-	wl.cursor = cursorshape;
+	clock_gettime(CLOCK_MONOTONIC, &starttime);
 
 	ARGBEGIN {
 	case 'a':
 		allowaltscreen = 0;
 		break;
+	case 'B':
+		opt_bench = 1;
+		break;
 	case 'c':
 		opt_class = EARGF(usage());
 		break;
+	case 'd':
+		opt_daemon = 1;
+		break;
 	case 'e':
 		if (argc > 0)
 			--argc, ++argv;
@@ -4532,6 +8143,18 @@ main(int argc, char *argv[])
 	case 'o':
 		opt_io = EARGF(usage());
 		break;
+	case 'P':
+		opt_replayfast = 1;
+		/* FALLTHROUGH */
+	case 'p':
+		opt_replay = EARGF(usage());
+		break;
+	case 'r':
+		opt_rec = EARGF(usage());
+		break;
+	case 'S':
+		opt_trace = 1;
+		break;
 	case 'l':
 		opt_line = EARGF(usage());
 		break;
@@ -4559,10 +8182,20 @@ run:
 		if (!opt_title && !opt_line)
 			opt_title = basename(xstrdup(argv[0]));
 	}
+	/* before any font or Wayland setup, that is the daemon's job */
+	if (opt_daemon && !opt_line && daemoninit())
+		return 0;
 	setlocale(LC_CTYPE, "");
-	tnew(MAX(cols, 1), MAX(rows, 1));
-	wlinit();
 	selinit();
+	if (opt_bench) {
+		bench();
+		return 0;
+	}
+	wlinit();
+	/* run() starts its shell */
+	win->shown = sessionnew(win, MAX(cols, 1), MAX(rows, 1));
+	hintinit();
+	keyinit();
 	run();
 
 	return 0;